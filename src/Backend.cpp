@@ -21,6 +21,8 @@ using std::string;
 using XenBackend::Exception;
 using XenBackend::FrontendHandlerPtr;
 
+extern std::string gCfgFileName;
+
 void CameraFrontendHandler::onBind()
 {
     LOG(mLog, DEBUG) << "On frontend bind : " << getDomId();
@@ -47,24 +49,75 @@ void CameraFrontendHandler::onBind()
 
     mCameraHandler = mCameraManager->getCameraHandler(uniqueId);
 
-    EventRingBufferPtr eventRingBuffer(new EventRingBuffer(getDomId(),
+    /* One grant table handle for all the pages of the frontend. */
+    GrantMapperPtr mapper(new XenGrantMapper(getDomId()));
+
+    EventRingBufferPtr eventRingBuffer(new EventRingBuffer(mapper,
+                                                           getDomId(),
                                                            evt_port,
                                                            evt_ref,
                                                            XENCAMERA_IN_RING_OFFS,
                                                            XENCAMERA_IN_RING_SIZE));
 
-    addRingBuffer(eventRingBuffer);
+    auto config = mCameraManager->getConfig();
+
+    SharedBuffersPublisher publisher;
+
+    if (sharedBuffersNegotiate(config->getBackendConfig().sharedBuffers))
+        publisher = [this](const std::vector<grant_ref_t>& directories) {
+            sharedBuffersPublish(directories);
+        };
 
-    CtrlRingBufferPtr ctrlRingBuffer(new CtrlRingBuffer(eventRingBuffer,
+    CtrlRingBufferPtr ctrlRingBuffer(new CtrlRingBuffer(mapper,
+                                                        eventRingBuffer,
                                                         getDomId(),
                                                         req_port,
                                                         req_ref,
                                                         controls,
-                                                        mCameraHandler));
+                                                        mCameraHandler,
+                                                        config->getBackendConfig(),
+                                                        publisher));
 
     addRingBuffer(ctrlRingBuffer);
 }
 
+/*
+ * The shared buffers extension is used if the frontend has requested it
+ * and it is enabled: the answer is written before the backend connects.
+ */
+bool CameraFrontendHandler::sharedBuffersNegotiate(bool enabled)
+{
+    string field = string("/") + XENCAMERA_FIELD_SHARED_BUFFERS;
+    string requestPath = getXsFrontendPath() + field;
+
+    bool requested = getXenStore().checkIfExist(requestPath) &&
+        getXenStore().readInt(requestPath) == 1;
+
+    if (requested && !enabled)
+        LOG(mLog, WARNING) << "Frontend " << getDomId() <<
+            " requests shared buffers, but they are disabled";
+
+    getXenStore().writeInt(getXsBackendPath() + field, requested && enabled);
+
+    return requested && enabled;
+}
+
+void CameraFrontendHandler::sharedBuffersPublish(
+    const std::vector<grant_ref_t>& directories)
+{
+    string value;
+
+    for (auto ref : directories) {
+        if (!value.empty())
+            value += XENCAMERA_LIST_SEPARATOR;
+
+        value += to_string(ref);
+    }
+
+    getXenStore().writeString(getXsBackendPath() + "/" +
+                              XENCAMERA_FIELD_SHARED_BUFFERS_DIR, value);
+}
+
 void CameraFrontendHandler::onStateClosed()
 {
     mCameraHandler.reset();
@@ -96,7 +149,35 @@ void Backend::onNewFrontend(domid_t domId, uint16_t devId)
 
 void Backend::init()
 {
-    mCameraManager.reset(new CameraManager());
+    mConfig.reset(new Config(gCfgFileName));
+
+    mCameraManager.reset(new CameraManager(mConfig));
+
+    /*
+     * Cameras are pre-warmed in the background while the backend starts
+     * serving frontends, so those binding during boot find their camera
+     * ready or being brought up.
+     */
+    mCameraManager->prewarm();
+}
+
+void Backend::reloadConfig()
+{
+    LOG(mLog, INFO) << "Reload configuration";
+
+    ConfigPtr config;
+
+    try {
+        config.reset(new Config(gCfgFileName));
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+        LOG(mLog, ERROR) << "Keep the current configuration";
+
+        return;
+    }
+
+    mConfig = config;
+    mCameraManager->reloadConfig(config);
 }
 
 void Backend::release()
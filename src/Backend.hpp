@@ -11,6 +11,7 @@
 
 #include <list>
 #include <string>
+#include <vector>
 
 #include <xen/be/BackendBase.hpp>
 #include <xen/be/FrontendHandlerBase.hpp>
@@ -41,6 +42,9 @@ private:
 
     CameraManagerPtr mCameraManager;
     CameraHandlerPtr mCameraHandler;
+
+    bool sharedBuffersNegotiate(bool enabled);
+    void sharedBuffersPublish(const std::vector<grant_ref_t>& directories);
 };
 
 class Backend : public XenBackend::BackendBase
@@ -49,9 +53,16 @@ public:
     Backend(const std::string& deviceName);
     ~Backend();
 
+    /*
+     * Re-read the configuration file and reconfigure the media pipelines
+     * which have changed. The current configuration is kept on errors.
+     */
+    void reloadConfig();
+
 private:
     XenBackend::Log mLog;
 
+    ConfigPtr mConfig;
     CameraManagerPtr mCameraManager;
 
     void init();
@@ -10,13 +10,17 @@
  * Copyright (C) 2018 EPAM Systems Inc.
  */
 
+#include <algorithm>
+#include <fstream>
+
 #include <fcntl.h>
-#include <signal.h>
 #include <unistd.h>
 
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #include "Camera.hpp"
 
@@ -26,12 +30,36 @@
 using XenBackend::Exception;
 using XenBackend::PollFd;
 
-Camera::Camera(const std::string devName):
+extern std::string gCacheDirName;
+
+const uint32_t Camera::cCapsCacheMagic;
+const uint32_t Camera::cCapsCacheVersion;
+
+Camera::Camera(const std::string devName, ReactorPtr reactor):
     mLog("Camera"),
     mUniqueId(devName),
     mDevPath("/dev/" + devName),
     mFd(-1),
-    mFrameDoneCallback(nullptr)
+    mReactor(reactor),
+    mFrameDoneCallback(nullptr),
+    mBuffersQueued(false),
+    mIdleTimeout(0),
+    mIdleHysteresis(0),
+    mPaused(false),
+    mWakeRequested(false),
+    mStopRequested(false),
+    mRecoveries(0),
+    mRecoverFd(-1),
+    mLastFrameTime(0),
+    mWatchdogFrames(0),
+    mWatchdogTimeout(0),
+    mWatchdogTerminate(false),
+    mWatchdogFd(-1),
+    mBusyPollWindow(0),
+    mFrameIntervalEst(0),
+    mBusyPollStats {},
+    mControlFd(-1),
+    mCapsCached(false)
 {
     try {
         init();
@@ -55,16 +83,22 @@ void Camera::init()
     if (!isCaptureDevice())
         throw Exception(mDevPath + " is not a camera device", ENOTTY);
 
-    formatEnumerate();
-    controlEnumerate();
+    if (!capsCacheLoad()) {
+        formatEnumerate();
+        controlEnumerate();
+        capsCacheStore();
+    }
 
-    mPollFd.reset(new PollFd(mFd, POLLIN));
+    controlSubscribe();
 }
 
 void Camera::release()
 {
     LOG(mLog, DEBUG) << "Deleting camera device " << mDevPath;
 
+    controlEventsStop();
+
+    mControlPollFd.reset();
     mPollFd.reset();
     close();
 }
@@ -185,6 +219,11 @@ bool Camera::isCaptureDevice()
     LOG(mLog, DEBUG) << "Card:     " << cap.card;
     LOG(mLog, DEBUG) << "Bus info: " << cap.bus_info;
 
+    mCapsCacheKey = std::string(reinterpret_cast<char *>(cap.driver)) + "-" +
+        std::string(reinterpret_cast<char *>(cap.card)) + "-" +
+        std::string(reinterpret_cast<char *>(cap.bus_info)) + "-" +
+        std::to_string(cap.version);
+
     return true;
 }
 
@@ -243,7 +282,7 @@ void Camera::bufferQueue(int index)
 {
     v4l2_buffer buf {0};
 
-    DLOG(mLog, DEBUG) << "[VIDIOC_QBUF] index " << std::to_string(index) <<
+    DLOG(mLog, DEBUG) << "[VIDIOC_QBUF] index " << index <<
         " for device " << mDevPath;
     buf.type = cV4L2BufType;
     buf.memory = cMemoryType;
@@ -288,211 +327,968 @@ void *Camera::bufferGetData(int index)
     return mBuffers[index].data;
 }
 
+size_t Camera::bufferGetSize(int index)
+{
+    return mBuffers[index].size;
+}
+
+void Camera::bufferHold(int index)
+{
+    std::lock_guard<std::mutex> lock(mBufferLock);
+
+    mBuffers[index].holds++;
+}
+
+void Camera::bufferRelease(int index)
+{
+    std::lock_guard<std::mutex> lock(mBufferLock);
+
+    auto& buffer = mBuffers[index];
+
+    if (buffer.holds <= 0)
+        return;
+
+    /* If the stream is stopped, the buffer is queued when it is started. */
+    if (--buffer.holds == 0 && mBuffersQueued)
+        bufferQueue(index);
+}
+
 /*
  ********************************************************************
  * Stream related functionality.
  ********************************************************************
  */
 
+int Camera::bufferTryDequeue(v4l2_buffer& buf)
+{
+    memset(&buf, 0, sizeof(buf));
+
+    buf.type = cV4L2BufType;
+    buf.memory = cMemoryType;
+
+    return xioctl(VIDIOC_DQBUF, &buf);
+}
+
 void Camera::eventThread()
 {
+    mThreadConfig.apply("cam-" + mUniqueId);
+
+    while (true) {
+        if (mBusyPollWindow.count()) {
+            int polled = busyPoll();
+
+            if (polled < 0)
+                break;
+
+            if (polled > 0)
+                continue;
+        }
+
+        try {
+            if (!mPollFd->poll())
+                break;
+        } catch(const std::exception& e) {
+            LOG(mLog, ERROR) << e.what();
+
+            if (!streamRecover())
+                break;
+
+            continue;
+        }
+
+        if (!eventProcess())
+            break;
+    }
+}
+
+/*
+ * Handle the frame which is ready. Returns false if frames should not
+ * be waited for anymore.
+ */
+bool Camera::eventProcess()
+{
+    v4l2_buffer buf;
+
     try {
-        while (mPollFd->poll()) {
-            v4l2_buffer buf = bufferDequeue();
+        if (bufferTryDequeue(buf) < 0) {
+            /* Spurious wake up, the buffer is not ready yet. */
+            if (errno == EAGAIN)
+                return true;
 
-            if (mFrameDoneCallback)
-                mFrameDoneCallback(buf.index, buf.bytesused);
-            bufferQueue(buf.index);
+            throw Exception("Failed to call [VIDIOC_DQBUF] for device " +
+                            mDevPath, errno);
         }
     } catch(const std::exception& e) {
         LOG(mLog, ERROR) << e.what();
 
-        kill(getpid(), SIGTERM);
+        return streamRecover();
     }
+
+    return frameProcess(buf, false);
 }
 
-void Camera::streamStart(FrameDoneCallback clb)
+/*
+ * Handle the frame which has been dequeued. Returns false if frames should
+ * not be waited for anymore.
+ */
+bool Camera::frameProcess(const v4l2_buffer& buf, bool polled)
 {
-    mFrameDoneCallback = clb;
+    try {
+        auto now = std::chrono::steady_clock::now();
+
+        if (mBusyPollWindow.count()) {
+            auto timestamp = now;
+
+            /* Monotonic buffer timestamps are of the steady clock. */
+            if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+                V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+                timestamp = std::chrono::steady_clock::time_point(
+                    std::chrono::duration_cast<
+                        std::chrono::steady_clock::duration>(
+                        std::chrono::seconds(buf.timestamp.tv_sec) +
+                        std::chrono::microseconds(buf.timestamp.tv_usec)));
+
+            auto delta = timestamp - mLastTimestamp;
+
+            /* Skipped or repeated frames do not tell the interval. */
+            if (delta > mFrameIntervalEst / 2 && delta < mFrameIntervalEst * 3 / 2)
+                mFrameIntervalEst = (mFrameIntervalEst * 7 +
+                    std::chrono::duration_cast<std::chrono::microseconds>(
+                        delta)) / 8;
+
+            mLastTimestamp = timestamp;
+            mNextFrameTime = timestamp + mFrameIntervalEst;
+
+            if (polled) {
+                mBusyPollStats.polledFrames++;
+                mBusyPollStats.polledLatency += now - timestamp;
+            } else {
+                mBusyPollStats.waitedFrames++;
+                mBusyPollStats.waitedLatency += now - timestamp;
+            }
+        }
 
-    mThread = std::thread(&Camera::eventThread, this);
+        mLastFrameTime = now.time_since_epoch().count();
+        mRecoveries = 0;
 
-    v4l2_buf_type type = cV4L2BufType;
+        bool consumed = false;
 
-    if (xioctl(VIDIOC_STREAMON, &type) < 0)
-        LOG(mLog, ERROR) << "Failed to start streaming on device " << mDevPath;
+        bufferHold(buf.index);
+
+        try {
+            if (mFrameDoneCallback)
+                consumed = mFrameDoneCallback(buf.index, buf.bytesused);
+        } catch(...) {
+            bufferRelease(buf.index);
+            throw;
+        }
+
+        bufferRelease(buf.index);
+
+        if (consumed)
+            mLastConsumedTime = now;
+        else if (streamIsIdle() && !streamPause())
+            return false;
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+
+        return streamRecover();
+    }
 
-    LOG(mLog, DEBUG) << "Started streaming on device " << mDevPath;
+    return true;
 }
 
-void Camera::streamStop()
+/*
+ * Sleep until shortly before the next frame is expected, then spin on
+ * dequeueing it. Returns 1 if the frame has been handled, 0 if it has not
+ * come in time and should be waited for, -1 if the stream is being stopped.
+ */
+int Camera::busyPoll()
 {
-    if (mPollFd)
-        mPollFd->stop();
+    /* Nothing to expect before the first frame or after a late one. */
+    if (mNextFrameTime == std::chrono::steady_clock::time_point())
+        return 0;
 
-    if (mThread.joinable())
-        mThread.join();
+    auto now = std::chrono::steady_clock::now();
+    auto wakeTime = mNextFrameTime - mBusyPollWindow;
 
-    v4l2_buf_type type = cV4L2BufType;
+    if (wakeTime > now &&
+        !eventThreadWait(std::chrono::duration_cast<std::chrono::microseconds>(
+            wakeTime - now)))
+        return -1;
 
-    if (xioctl(VIDIOC_STREAMOFF, &type) < 0)
-        LOG(mLog, ERROR) << "Failed to stop streaming for " << mDevPath;
+    /* The spin is bounded, so the stop request is only checked before. */
+    auto deadline = mNextFrameTime + mBusyPollWindow;
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        v4l2_buffer buf;
+
+        if (bufferTryDequeue(buf) == 0)
+            return frameProcess(buf, true) ? 1 : -1;
+
+        /* Errors are handled on the usual path. */
+        if (errno != EAGAIN)
+            return 0;
+    }
+
+    mBusyPollStats.lateFrames++;
+    mNextFrameTime = std::chrono::steady_clock::time_point();
 
-    LOG(mLog, DEBUG) << "Stopped streaming on device " << mDevPath;
+    return 0;
 }
 
-int Camera::streamAlloc(int numBuffers)
+void Camera::busyPollReport()
 {
-    int numAllocated = bufferRequest(numBuffers);
+    auto& stats = mBusyPollStats;
 
-    if (numAllocated != numBuffers)
-        LOG(mLog, WARNING) << "Allocated " << numAllocated <<
-            ", expected " << numBuffers;
+    if (!stats.polledFrames && !stats.waitedFrames)
+        return;
 
-    for (int i = 0; i < numAllocated; i++) {
-        v4l2_buffer buf = bufferQuery(i);
+    auto average = [](std::chrono::nanoseconds total, uint64_t count) {
+        return count ? std::chrono::duration_cast<std::chrono::microseconds>(
+            total / count).count() : 0;
+    };
 
-        void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE,
-                           MAP_SHARED, mFd, buf.m.offset);
+    auto polledLatency = average(stats.polledLatency, stats.polledFrames);
+    auto waitedLatency = average(stats.waitedLatency, stats.waitedFrames);
 
-        if (start == MAP_FAILED)
-            throw Exception("Failed to mmap buffer for device " +
-                            mDevPath, errno);
+    LOG(mLog, INFO) << "Busy poll on device " << mDevPath << ": " <<
+        stats.polledFrames << " frames polled in " << polledLatency <<
+        " us, " << stats.waitedFrames << " waited in " << waitedLatency <<
+        " us, " << stats.lateFrames << " late" <<
+        (stats.polledFrames && stats.waitedFrames ?
+            ", saved " + std::to_string(waitedLatency - polledLatency) +
+            " us per frame" : "");
+}
 
-        bufferQueue(i);
+std::chrono::microseconds Camera::frameIntervalGet()
+{
+    std::chrono::microseconds interval = cDefaultFrameInterval;
 
-        mBuffers.push_back(
-            {
-                .size = static_cast<size_t>(buf.length),
-                .data = start
-            }
-        );
+    try {
+        auto frameInterval = toFrameInterval(frameRateGet());
+
+        if (frameInterval.count())
+            interval = frameInterval;
+    } catch(const std::exception& e) {
+        LOG(mLog, WARNING) << e.what();
     }
 
-    return numAllocated;
+    return interval;
 }
 
-void Camera::streamRelease()
+void Camera::eventThreadStart()
 {
-    DLOG(mLog, DEBUG) << "Release all buffers";
-    for (auto const& buffer: mBuffers)
-        munmap(buffer.data, buffer.size);
+    mStopRequested = false;
+    mPaused = false;
+    mRecoveries = 0;
+    mLastFrameTime = std::chrono::steady_clock::now().time_since_epoch().count();
+    mNextFrameTime = std::chrono::steady_clock::time_point();
+
+    if (mReactor) {
+        mRecoverFd = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (mRecoverFd >= 0)
+            mReactor->add(mRecoverFd, EPOLLIN,
+                          [this] { return recoverProcess(); });
+        else
+            LOG(mLog, ERROR) << "Failed to create recovery timer for device " <<
+                mDevPath << ", errno " << errno;
+
+        mReactor->add(mFd, EPOLLIN, [this] { return eventProcess(); });
+        return;
+    }
 
-    mBuffers.clear();
+    /*
+     * Poll is re-created for every thread, so a stop request which has
+     * not been consumed by the previous thread does not affect this one.
+     */
+    mPollFd.reset(new PollFd(mFd, POLLIN));
+
+    mThread = std::thread(&Camera::eventThread, this);
+}
+
+void Camera::eventThreadStop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mPauseLock);
+
+        /* Wake up the event thread if it is paused or backing off. */
+        mStopRequested = true;
+        mPauseCondition.notify_all();
+    }
+
+    /* Removed first, so a running recovery can't arm the device anymore. */
+    if (mRecoverFd >= 0) {
+        mReactor->remove(mRecoverFd);
+        ::close(mRecoverFd);
+        mRecoverFd = -1;
+    }
+
+    if (mReactor)
+        mReactor->remove(mFd);
+
+    if (mThread.joinable()) {
+        mPollFd->stop();
+        mThread.join();
+    }
 }
 
 /*
- ********************************************************************
- * Format related functionality.
- ********************************************************************
+ * Wait for the given time on the event thread unless the stream is
+ * being stopped. Returns false if it is.
  */
-v4l2_format Camera::formatGet()
+bool Camera::eventThreadWait(std::chrono::microseconds time)
 {
-    v4l2_format fmt {0};
-
-    fmt.type = cV4L2BufType;
+    std::unique_lock<std::mutex> lock(mPauseLock);
 
-    if (xioctl(VIDIOC_G_FMT, &fmt) < 0)
-        throw Exception("Failed to call [VIDIOC_G_FMT] for device " +
-                        mDevPath, errno);
-    return fmt;
+    return !mPauseCondition.wait_for(lock, time, [this] {
+        return mStopRequested;
+    });
 }
 
-void Camera::formatSet(v4l2_format fmt)
+void Camera::streamOn()
 {
-    LOG(mLog, DEBUG) << "Set format to " << fmt.fmt.pix.width <<
-        "x" << fmt.fmt.pix.height;
+    v4l2_buf_type type = cV4L2BufType;
 
-    fmt.type = cV4L2BufType;
+    {
+        std::lock_guard<std::mutex> lock(mBufferLock);
 
-    if (xioctl(VIDIOC_S_FMT, &fmt) < 0)
-        throw Exception("Failed to call [VIDIOC_S_FMT] for device " +
+        if (!mBuffersQueued) {
+            for (size_t i = 0; i < mBuffers.size(); i++)
+                if (!mBuffers[i].holds)
+                    bufferQueue(i);
+
+            mBuffersQueued = true;
+        }
+    }
+
+    if (xioctl(VIDIOC_STREAMON, &type) < 0)
+        throw Exception("Failed to call [VIDIOC_STREAMON] for device " +
                         mDevPath, errno);
 }
 
-void Camera::formatTry(v4l2_format *fmt)
+void Camera::streamOff()
 {
-    LOG(mLog, DEBUG) << "Try format " << fmt->fmt.pix.width <<
-        "x" << fmt->fmt.pix.height;
+    v4l2_buf_type type = cV4L2BufType;
 
-    fmt->type = cV4L2BufType;
+    /* Buffers are dequeued even if the call fails. */
+    {
+        std::lock_guard<std::mutex> lock(mBufferLock);
 
-    if (xioctl(VIDIOC_TRY_FMT, fmt) < 0)
-        throw Exception("Failed to call [VIDIOC_TRY_FMT] for device " +
+        mBuffersQueued = false;
+    }
+
+    if (xioctl(VIDIOC_STREAMOFF, &type) < 0)
+        throw Exception("Failed to call [VIDIOC_STREAMOFF] for device " +
                         mDevPath, errno);
 }
 
-void Camera::formatSet(uint32_t width, uint32_t height, uint32_t pixelFormat)
+/*
+ * Called from the event thread on capture errors: restart the stream
+ * in place, backing off between attempts. Returns false if the stream
+ * could not be recovered or is being stopped.
+ */
+bool Camera::streamRecover()
 {
-    v4l2_format fmt = formatGet();
+    /* Reactor threads are shared: the restart is scheduled instead. */
+    if (mReactor)
+        return recoverSchedule();
 
-    fmt.fmt.pix.width = width;
-    fmt.fmt.pix.height = height;
-    fmt.fmt.pix.pixelformat = pixelFormat;
+    while (mRecoveries < cMaxRecoveries) {
+        auto backoff = cRecoveryBackoff * (1 << mRecoveries++);
 
-    formatSet(fmt);
+        LOG(mLog, WARNING) << "Restarting stream on device " << mDevPath <<
+            " in " << backoff.count() << " ms, attempt " << mRecoveries;
+
+        if (!eventThreadWait(backoff))
+            return false;
+
+        try {
+            try {
+                streamOff();
+            } catch(const std::exception& e) {
+                LOG(mLog, WARNING) << e.what();
+            }
+
+            streamOn();
+
+            return true;
+        } catch(const std::exception& e) {
+            LOG(mLog, ERROR) << e.what();
+        }
+    }
+
+    LOG(mLog, ERROR) << "Failed to recover stream on device " << mDevPath;
+
+    return false;
 }
 
-void Camera::formatEnumerate()
+/*
+ * Reactor counterpart of streamRecover: set the recovery timer for the
+ * back-off. Returns false, so the device stays disarmed till the stream
+ * is restarted.
+ */
+bool Camera::recoverSchedule()
 {
-    v4l2_fmtdesc fmt = {0};
+    if (mRecoveries >= cMaxRecoveries) {
+        LOG(mLog, ERROR) << "Failed to recover stream on device " << mDevPath;
 
-    mFormats.clear();
+        return false;
+    }
 
-    fmt.type = cV4L2BufType;
+    auto backoff = cRecoveryBackoff * (1 << mRecoveries++);
 
-    /* TODO:
-     * 1. Multi-planar formats are not supported yet.
-     * 2. Continuous/step-wise sizes/intervals are not supported.
-     */
-    while (xioctl(VIDIOC_ENUM_FMT, &fmt) >= 0) {
-        Format format = {
-            .pixelFormat = fmt.pixelformat,
-            .description = std::string(reinterpret_cast<char *>(fmt.description)),
-        };
+    LOG(mLog, WARNING) << "Restarting stream on device " << mDevPath <<
+        " in " << backoff.count() << " ms, attempt " << mRecoveries;
 
-        v4l2_frmsizeenum size;
-        int index = 0;
+    itimerspec spec {0};
 
-        while (frameSizeGet(index++, fmt.pixelformat, size) >= 0) {
-            FormatSize formatSize;
+    spec.it_value.tv_sec = backoff.count() / 1000;
+    spec.it_value.tv_nsec = (backoff.count() % 1000) * 1000000;
 
-            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
-                v4l2_frmivalenum interval;
-                int index = 0;
+    if (mRecoverFd < 0 || timerfd_settime(mRecoverFd, 0, &spec, nullptr) < 0)
+        LOG(mLog, ERROR) << "Failed to schedule stream recovery on device " <<
+            mDevPath << ", errno " << errno;
 
-                formatSize.width = size.discrete.width;
-                formatSize.height = size.discrete.height;
+    return false;
+}
 
-                while (frameIntervalGet(index++, fmt.pixelformat,
-                                        size.discrete.width,
-                                        size.discrete.height,
-                                        interval) >= 0)
-                    formatSize.fps.push_back(interval.discrete);
-            } else {
-                LOG(mLog, WARNING) <<
-                    "Step-wise/continuous intervals are not supported " << mDevPath;
-                continue;
-            }
+/*
+ * Called from the reactor when the recovery back-off has passed.
+ */
+bool Camera::recoverProcess()
+{
+    uint64_t expirations;
 
-            format.size.push_back(formatSize);
+    if (read(mRecoverFd, &expirations, sizeof(expirations)) < 0) {
+        if (errno == EAGAIN)
+            return true;
+
+        throw Exception("Failed to read recovery timer for device " +
+                        mDevPath, errno);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mPauseLock);
+
+        if (mStopRequested)
+            return true;
+    }
+
+    try {
+        try {
+            streamOff();
+        } catch(const std::exception& e) {
+            LOG(mLog, WARNING) << e.what();
         }
 
-        fmt.index++;
+        streamOn();
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
 
-        mFormats.push_back(format);
+        recoverSchedule();
+
+        return true;
     }
+
+    mReactor->arm(mFd);
+
+    return true;
+}
+
+bool Camera::streamIsIdle()
+{
+    if (!mIdleTimeout.count())
+        return false;
+
+    auto now = std::chrono::steady_clock::now();
+
+    return now - mLastConsumedTime >= mIdleTimeout &&
+        now - mStreamOnTime >= mIdleHysteresis;
 }
 
 /*
- ********************************************************************
- * Frame rate related functionality.
- ********************************************************************
+ * Called from the event thread: stop streaming and wait for the stream
+ * to be woken up. Returns false if the stream is being stopped instead.
  */
-v4l2_fract Camera::frameRateGet()
+bool Camera::streamPause()
 {
-     v4l2_streamparm parm {0};
-     v4l2_fract frameRate;
+    std::unique_lock<std::mutex> lock(mPauseLock);
+
+    if (mStopRequested)
+        return false;
+
+    streamOff();
+
+    mPaused = true;
+    mWakeRequested = false;
+
+    LOG(mLog, DEBUG) << "Paused idle streaming on device " << mDevPath;
+
+    /* Reactor threads are shared: the stream is resumed on wake instead. */
+    if (mReactor)
+        return false;
+
+    mPauseCondition.wait(lock, [this] {
+        return mWakeRequested || mStopRequested;
+    });
+
+    mPaused = false;
+
+    if (mStopRequested)
+        return false;
+
+    streamOn();
+
+    auto now = std::chrono::steady_clock::now();
+
+    /* The watchdog must not take the pause for missing frames. */
+    mStreamOnTime = mLastConsumedTime = now;
+    mLastFrameTime = now.time_since_epoch().count();
+
+    LOG(mLog, DEBUG) << "Resumed streaming on device " << mDevPath;
+
+    return true;
+}
+
+void Camera::streamSetIdlePolicy(std::chrono::milliseconds timeout,
+                                 std::chrono::milliseconds hysteresis)
+{
+    mIdleTimeout = timeout;
+    mIdleHysteresis = hysteresis;
+}
+
+void Camera::streamWake()
+{
+    std::lock_guard<std::mutex> lock(mPauseLock);
+
+    if (!mPaused)
+        return;
+
+    if (!mReactor) {
+        mWakeRequested = true;
+        mPauseCondition.notify_all();
+        return;
+    }
+
+    if (mStopRequested)
+        return;
+
+    mPaused = false;
+
+    try {
+        streamOn();
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+
+    mStreamOnTime = mLastConsumedTime = now;
+    mLastFrameTime = now.time_since_epoch().count();
+
+    LOG(mLog, DEBUG) << "Resumed streaming on device " << mDevPath;
+
+    mReactor->arm(mFd);
+}
+
+void Camera::streamSetThreadConfig(const ThreadConfig& threadConfig)
+{
+    mThreadConfig = threadConfig;
+}
+
+void Camera::streamSetBusyPoll(std::chrono::microseconds window)
+{
+    mBusyPollWindow = window;
+}
+
+void Camera::streamSetWatchdog(int numFrames)
+{
+    mWatchdogFrames = numFrames;
+}
+
+void Camera::watchdogStart()
+{
+    if (!mWatchdogFrames)
+        return;
+
+    auto interval = std::chrono::duration_cast<std::chrono::milliseconds>(
+        frameIntervalGet());
+
+    mWatchdogTimeout = interval * mWatchdogFrames;
+    mWatchdogTerminate = false;
+
+    if (!mReactor) {
+        mWatchdogThread = std::thread(&Camera::watchdogThread, this);
+        return;
+    }
+
+    mWatchdogFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (mWatchdogFd < 0) {
+        LOG(mLog, ERROR) << "Failed to create watchdog timer for device " <<
+            mDevPath << ", errno " << errno;
+        return;
+    }
+
+    itimerspec spec {0};
+
+    spec.it_value.tv_sec = mWatchdogTimeout.count() / 1000;
+    spec.it_value.tv_nsec = (mWatchdogTimeout.count() % 1000) * 1000000;
+    spec.it_interval = spec.it_value;
+
+    if (timerfd_settime(mWatchdogFd, 0, &spec, nullptr) < 0) {
+        LOG(mLog, ERROR) << "Failed to set watchdog timer for device " <<
+            mDevPath << ", errno " << errno;
+        ::close(mWatchdogFd);
+        mWatchdogFd = -1;
+        return;
+    }
+
+    mReactor->add(mWatchdogFd, EPOLLIN, [this] { return watchdogProcess(); });
+}
+
+void Camera::watchdogStop()
+{
+    if (mWatchdogFd >= 0) {
+        mReactor->remove(mWatchdogFd);
+        ::close(mWatchdogFd);
+        mWatchdogFd = -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mPauseLock);
+
+        mWatchdogTerminate = true;
+        mWatchdogCondition.notify_all();
+    }
+
+    if (mWatchdogThread.joinable())
+        mWatchdogThread.join();
+}
+
+void Camera::watchdogThread()
+{
+    std::unique_lock<std::mutex> lock(mPauseLock);
+
+    while (!mWatchdogTerminate) {
+        mWatchdogCondition.wait_for(lock, mWatchdogTimeout);
+
+        if (mWatchdogTerminate || !watchdogExpired())
+            continue;
+
+        lock.unlock();
+
+        watchdogRestart();
+
+        lock.lock();
+    }
+}
+
+/*
+ * Called from the reactor on the watchdog timer.
+ */
+bool Camera::watchdogProcess()
+{
+    uint64_t expirations;
+
+    /* Only the fact of expiration matters. */
+    if (read(mWatchdogFd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN)
+        throw Exception("Failed to read watchdog timer for device " +
+                        mDevPath, errno);
+
+    {
+        std::lock_guard<std::mutex> lock(mPauseLock);
+
+        if (!watchdogExpired())
+            return true;
+    }
+
+    watchdogRestart();
+
+    return true;
+}
+
+/*
+ * True if no frame has been captured for the watchdog timeout, unless
+ * the stream is paused on purpose. Must be called with mPauseLock held.
+ */
+bool Camera::watchdogExpired()
+{
+    if (mPaused)
+        return false;
+
+    auto lastFrameTime = std::chrono::steady_clock::time_point(
+        std::chrono::steady_clock::duration(mLastFrameTime));
+
+    return std::chrono::steady_clock::now() - lastFrameTime >= mWatchdogTimeout;
+}
+
+void Camera::watchdogRestart()
+{
+    LOG(mLog, WARNING) << "No frames for " << mWatchdogTimeout.count() <<
+        " ms, restarting stream on device " << mDevPath;
+
+    eventThreadStop();
+
+    try {
+        try {
+            streamOff();
+        } catch(const std::exception& e) {
+            LOG(mLog, WARNING) << e.what();
+        }
+
+        streamOn();
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+
+    mStreamOnTime = mLastConsumedTime = std::chrono::steady_clock::now();
+
+    eventThreadStart();
+}
+
+void Camera::streamStart(FrameDoneCallback clb)
+{
+    mFrameDoneCallback = clb;
+
+    if (mBusyPollWindow.count()) {
+        if (mReactor) {
+            LOG(mLog, WARNING) << "Busy poll is not used with the reactor";
+            mBusyPollWindow = std::chrono::microseconds(0);
+        } else {
+            mFrameIntervalEst = frameIntervalGet();
+            mBusyPollStats = BusyPollStats {};
+        }
+    }
+
+    mStreamOnTime = mLastConsumedTime = std::chrono::steady_clock::now();
+
+    eventThreadStart();
+
+    try {
+        streamOn();
+
+        LOG(mLog, DEBUG) << "Started streaming on device " << mDevPath;
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+
+    watchdogStart();
+}
+
+void Camera::streamStop()
+{
+    watchdogStop();
+    eventThreadStop();
+
+    if (mBusyPollWindow.count())
+        busyPollReport();
+
+    try {
+        streamOff();
+
+        LOG(mLog, DEBUG) << "Stopped streaming on device " << mDevPath;
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+}
+
+int Camera::streamAlloc(int numBuffers)
+{
+    int numAllocated = bufferRequest(numBuffers);
+
+    if (numAllocated != numBuffers)
+        LOG(mLog, WARNING) << "Allocated " << numAllocated <<
+            ", expected " << numBuffers;
+
+    for (int i = 0; i < numAllocated; i++) {
+        v4l2_buffer buf = bufferQuery(i);
+
+        void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, mFd, buf.m.offset);
+
+        if (start == MAP_FAILED)
+            throw Exception("Failed to mmap buffer for device " +
+                            mDevPath, errno);
+
+        bufferQueue(i);
+
+        mBuffers.push_back(
+            {
+                .size = static_cast<size_t>(buf.length),
+                .data = start,
+                .holds = 0
+            }
+        );
+    }
+
+    mBuffersQueued = true;
+
+    return numAllocated;
+}
+
+void Camera::streamRelease()
+{
+    DLOG(mLog, DEBUG) << "Release all buffers";
+    for (auto const& buffer: mBuffers)
+        munmap(buffer.data, buffer.size);
+
+    mBuffers.clear();
+    mBuffersQueued = false;
+}
+
+/*
+ ********************************************************************
+ * Format related functionality.
+ ********************************************************************
+ */
+v4l2_format Camera::formatGet()
+{
+    v4l2_format fmt {0};
+
+    fmt.type = cV4L2BufType;
+
+    if (xioctl(VIDIOC_G_FMT, &fmt) < 0)
+        throw Exception("Failed to call [VIDIOC_G_FMT] for device " +
+                        mDevPath, errno);
+    return fmt;
+}
+
+void Camera::formatSet(v4l2_format fmt)
+{
+    LOG(mLog, DEBUG) << "Set format to " << fmt.fmt.pix.width <<
+        "x" << fmt.fmt.pix.height;
+
+    fmt.type = cV4L2BufType;
+
+    if (xioctl(VIDIOC_S_FMT, &fmt) < 0)
+        throw Exception("Failed to call [VIDIOC_S_FMT] for device " +
+                        mDevPath, errno);
+}
+
+void Camera::formatTry(v4l2_format *fmt)
+{
+    LOG(mLog, DEBUG) << "Try format " << fmt->fmt.pix.width <<
+        "x" << fmt->fmt.pix.height;
+
+    fmt->type = cV4L2BufType;
+
+    if (xioctl(VIDIOC_TRY_FMT, fmt) < 0)
+        throw Exception("Failed to call [VIDIOC_TRY_FMT] for device " +
+                        mDevPath, errno);
+}
+
+void Camera::formatSet(uint32_t width, uint32_t height, uint32_t pixelFormat)
+{
+    v4l2_format fmt = formatGet();
+
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = pixelFormat;
+
+    formatSet(fmt);
+}
+
+void Camera::formatEnumerate()
+{
+    v4l2_fmtdesc fmt = {0};
+
+    mFormats.clear();
+
+    fmt.type = cV4L2BufType;
+
+    /* TODO:
+     * 1. Multi-planar formats are not supported yet.
+     * 2. Continuous/step-wise sizes/intervals are not supported.
+     */
+    while (xioctl(VIDIOC_ENUM_FMT, &fmt) >= 0) {
+        Format format = {
+            .pixelFormat = fmt.pixelformat,
+            .description = std::string(reinterpret_cast<char *>(fmt.description)),
+        };
+
+        v4l2_frmsizeenum size;
+        int index = 0;
+
+        while (frameSizeGet(index++, fmt.pixelformat, size) >= 0) {
+            FormatSize formatSize;
+
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                v4l2_frmivalenum interval;
+                int index = 0;
+
+                formatSize.width = size.discrete.width;
+                formatSize.height = size.discrete.height;
+
+                while (frameIntervalGet(index++, fmt.pixelformat,
+                                        size.discrete.width,
+                                        size.discrete.height,
+                                        interval) >= 0)
+                    formatSize.fps.push_back(interval.discrete);
+            } else {
+                LOG(mLog, WARNING) <<
+                    "Step-wise/continuous intervals are not supported " << mDevPath;
+                continue;
+            }
+
+            format.size.push_back(formatSize);
+        }
+
+        fmt.index++;
+
+        mFormats.push_back(format);
+    }
+}
+
+/*
+ * Cached formats are checked against the pixel formats and frame sizes
+ * the HW reports: these are cheap to query compared to the intervals.
+ */
+bool Camera::formatsValidate(const std::vector<Format>& formats)
+{
+    v4l2_fmtdesc fmt = {0};
+
+    fmt.type = cV4L2BufType;
+
+    for (auto const& format: formats) {
+        if (xioctl(VIDIOC_ENUM_FMT, &fmt) < 0 ||
+            fmt.pixelformat != format.pixelFormat)
+            return false;
+
+        v4l2_frmsizeenum size;
+        int index = 0;
+
+        for (auto const& formatSize: format.size) {
+            do {
+                if (frameSizeGet(index++, fmt.pixelformat, size) < 0)
+                    return false;
+            } while (size.type != V4L2_FRMSIZE_TYPE_DISCRETE);
+
+            if (static_cast<int>(size.discrete.width) != formatSize.width ||
+                static_cast<int>(size.discrete.height) != formatSize.height)
+                return false;
+        }
+
+        fmt.index++;
+    }
+
+    /* No more formats than the cached ones. */
+    return xioctl(VIDIOC_ENUM_FMT, &fmt) < 0;
+}
+
+/*
+ ********************************************************************
+ * Frame rate related functionality.
+ ********************************************************************
+ */
+v4l2_fract Camera::frameRateGet()
+{
+     v4l2_streamparm parm {0};
+     v4l2_fract frameRate;
 
      parm.type = cV4L2BufType;
 
@@ -573,6 +1369,7 @@ int Camera::frameIntervalGet(int index, uint32_t pixelFormat,
 void Camera::controlEnumerate()
 {
     v4l2_queryctrl queryctrl {0};
+    std::vector<ControlInfo> controls;
 
     queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
 
@@ -590,7 +1387,7 @@ void Camera::controlEnumerate()
                 ctrl.default_value = queryctrl.default_value;
                 ctrl.step = queryctrl.step;
 
-                mControls.push_back(ctrl);
+                controls.push_back(ctrl);
             }
         }
         queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
@@ -599,73 +1396,559 @@ void Camera::controlEnumerate()
     if (errno == ENOTTY) {
         LOG(mLog, WARNING) <<
             "Control querying is not supported for device " << mDevPath;
-        return;
+    } else if (errno != EINVAL) {
+        /*
+         * Querying after the last control must return EINVAL indicating
+         * that there are no more controls.
+         */
+        throw Exception("Failed to query controls for device " +
+                        mDevPath, errno);
     }
 
+    /* The control event thread may look the controls up meanwhile. */
+    std::lock_guard<std::mutex> lock(mControlLock);
+
+    mControls = std::move(controls);
+    controlIndexBuild();
+    mControlsValidated.clear();
+}
+
+void Camera::controlIndexBuild()
+{
+    mControlIndex.clear();
+
+    for (size_t i = 0; i < mControls.size(); i++)
+        mControlIndex[mControls[i].v4l2_cid] = i;
+}
+
+Camera::ControlInfo Camera::controlEnum(int v4l2_cid)
+{
+    ControlInfo info;
+
+    /* Check if this control is supported by the HW. */
+    if (controlFind(v4l2_cid, info))
+        return info;
+
     /*
-     * Querying after the last control must return EINVAL indicating
-     * that there are no more controls.
+     * Controls loaded from the capability cache are checked against
+     * the HW on their first use: if the cache turns out to be stale
+     * then drop it and enumerate the device again.
      */
-    if (errno != EINVAL)
-        throw Exception("Failed to query controls for device " +
-                        mDevPath, errno);
+    if (mCapsCached) {
+        capsCacheRefresh();
+
+        if (controlFind(v4l2_cid, info))
+            return info;
+    }
+
+    throw Exception("Control " + std::to_string(v4l2_cid) +
+                    " not found for device " + mDevPath, EINVAL);
 }
 
-Camera::ControlInfo Camera::controlEnum(std::string name)
+/*
+ * Controls loaded from the capability cache are only found once they
+ * are validated against the HW.
+ */
+bool Camera::controlFind(int v4l2_cid, ControlInfo& info)
 {
-    int v4l2_cid;
+    std::lock_guard<std::mutex> lock(mControlLock);
 
-    if (name == XENCAMERA_CTRL_CONTRAST_STR)
-        v4l2_cid = V4L2_CID_CONTRAST;
-    else if (name == XENCAMERA_CTRL_BRIGHTNESS_STR)
-        v4l2_cid = V4L2_CID_BRIGHTNESS;
-    else if (name == XENCAMERA_CTRL_HUE_STR)
-        v4l2_cid = V4L2_CID_HUE;
-    else if (name == XENCAMERA_CTRL_SATURATION_STR)
-        v4l2_cid = V4L2_CID_SATURATION;
-    else
-        throw Exception("Wrong control name " + name + " for device " +
-                        mDevPath, EINVAL);
+    auto ctrl = mControlIndex.find(v4l2_cid);
 
-    /* Check if this control is supported by the HW. */
-    for (auto const& ctrl: mControls)
-        if (ctrl.v4l2_cid == v4l2_cid)
-            return ctrl;
+    if (ctrl == mControlIndex.end())
+        return false;
+
+    if (mCapsCached && !controlValidate(mControls[ctrl->second]))
+        return false;
+
+    info = mControls[ctrl->second];
 
-    throw Exception("Control " + name + " not found for device " +
-                    mDevPath, EINVAL);
+    return true;
 }
 
-void Camera::controlSetValue(std::string name, signed int value)
+bool Camera::controlValidate(const ControlInfo& ctrl)
 {
-    v4l2_control control {0};
+    if (std::find(mControlsValidated.begin(), mControlsValidated.end(),
+                  ctrl.v4l2_cid) != mControlsValidated.end())
+        return true;
 
-    auto ctrl = controlEnum(name);
+    v4l2_queryctrl queryctrl {0};
 
-    control.id = ctrl.v4l2_cid;
-    control.value = value;
+    queryctrl.id = ctrl.v4l2_cid;
 
-    if (xioctl(VIDIOC_S_CTRL, &control) < 0)
-        throw Exception("Failed to call [VIDIOC_S_CTRL] for device " +
-                        mDevPath, errno);
+    if (xioctl(VIDIOC_QUERYCTRL, &queryctrl) < 0)
+        return false;
+
+    /* Inactive and grabbed flags change at run-time, do not compare. */
+    const int dynamicFlags = V4L2_CTRL_FLAG_INACTIVE | V4L2_CTRL_FLAG_GRABBED;
+
+    if ((queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) ||
+        (ctrl.flags & ~dynamicFlags) !=
+            (static_cast<int>(queryctrl.flags) & ~dynamicFlags) ||
+        ctrl.minimum != queryctrl.minimum ||
+        ctrl.maximum != queryctrl.maximum ||
+        ctrl.default_value != queryctrl.default_value ||
+        ctrl.step != queryctrl.step)
+        return false;
+
+    mControlsValidated.push_back(ctrl.v4l2_cid);
+
+    return true;
+}
+
+void Camera::controlSetValues(const std::vector<ControlValue>& values)
+{
+    std::vector<v4l2_ext_control> controls(values.size());
+
+    for (size_t i = 0; i < values.size(); i++) {
+        controls[i].id = controlEnum(values[i].v4l2_cid).v4l2_cid;
+        controls[i].value = values[i].value;
+    }
+
+    v4l2_ext_controls extControls {0};
+
+    extControls.which = V4L2_CTRL_WHICH_CUR_VAL;
+    extControls.count = controls.size();
+    extControls.controls = controls.data();
+
+    std::lock_guard<std::mutex> lock(mControlLock);
+
+    if (xioctl(VIDIOC_S_EXT_CTRLS, &extControls) < 0) {
+        if (errno != ENOTTY)
+            throw Exception("Failed to call [VIDIOC_S_EXT_CTRLS] for device " +
+                            mDevPath, errno);
+
+        /* Extended controls are not supported, set one by one. */
+        for (auto& ctrl : controls) {
+            v4l2_control control {0};
+
+            control.id = ctrl.id;
+            control.value = ctrl.value;
+
+            if (xioctl(VIDIOC_S_CTRL, &control) < 0)
+                throw Exception("Failed to call [VIDIOC_S_CTRL] for device " +
+                                mDevPath, errno);
+
+            ctrl.value = control.value;
+        }
+    }
+
+    /*
+     * Changes made via this file handle are not reported as events,
+     * so update the cache now with the values the driver has set.
+     */
+    for (auto const& ctrl : controls)
+        if (mControlsSubscribed.count(ctrl.id))
+            mControlValues[ctrl.id] = ctrl.value;
 }
 
 signed int Camera::controlGetValue(int v4l2_cid)
 {
     v4l2_control control {0};
 
+    std::lock_guard<std::mutex> lock(mControlLock);
+
+    auto it = mControlValues.find(v4l2_cid);
+
+    if (it != mControlValues.end())
+        return it->second;
+
     control.id = v4l2_cid;
 
     if (xioctl(VIDIOC_G_CTRL, &control) < 0)
         throw Exception("Failed to call [VIDIOC_G_CTRL] for device " +
                         mDevPath, errno);
+
+    if (mControlsSubscribed.count(v4l2_cid))
+        mControlValues[v4l2_cid] = control.value;
+
     return control.value;
 }
 
-signed int Camera::controlGetValue(std::string name)
+void Camera::controlSetChangeCallback(ControlChangeCallback clb)
+{
+    std::lock_guard<std::mutex> lock(mControlLock);
+
+    mControlChangeCallback = clb;
+}
+
+void Camera::controlEventsStop()
+{
+    if (mControlFd >= 0) {
+        mReactor->remove(mControlFd);
+        ::close(mControlFd);
+        mControlFd = -1;
+
+        controlEventsInvalidate();
+    }
+
+    if (mControlThread.joinable()) {
+        mControlPollFd->stop();
+        mControlThread.join();
+    }
+}
+
+/*
+ * Subscribe to value change events of all the controls, but volatile
+ * ones, which are always read from the HW.
+ */
+void Camera::controlSubscribe()
+{
+    std::unordered_set<int> subscribed;
+
+    for (auto const& ctrl : mControls) {
+        if (ctrl.flags & V4L2_CTRL_FLAG_VOLATILE)
+            continue;
+
+        v4l2_event_subscription sub {0};
+
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id = ctrl.v4l2_cid;
+
+        if (xioctl(VIDIOC_SUBSCRIBE_EVENT, &sub) < 0) {
+            if (errno == ENOTTY) {
+                LOG(mLog, WARNING) <<
+                    "Control events are not supported for device " << mDevPath;
+                subscribed.clear();
+                break;
+            }
+
+            LOG(mLog, WARNING) << "Failed to subscribe to control " <<
+                ctrl.v4l2_cid << " events for device " << mDevPath;
+            continue;
+        }
+
+        subscribed.insert(ctrl.v4l2_cid);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mControlLock);
+
+        mControlsSubscribed = std::move(subscribed);
+        mControlValues.clear();
+
+        if (mControlsSubscribed.empty())
+            return;
+    }
+
+    /* Re-subscribing after a capability refresh keeps the waiter. */
+    if (mControlThread.joinable() || mControlFd >= 0)
+        return;
+
+    if (!mReactor) {
+        mControlPollFd.reset(new PollFd(mFd, POLLPRI));
+
+        mControlThread = std::thread(&Camera::controlEventThread, this);
+        return;
+    }
+
+    mControlFd = dup(mFd);
+
+    if (mControlFd < 0)
+        throw Exception("Failed to duplicate descriptor of device " +
+                        mDevPath, errno);
+
+    mReactor->add(mControlFd, EPOLLPRI, [this] {
+        return controlEventsHandle();
+    });
+}
+
+void Camera::controlEventThread()
+{
+    try {
+        while (mControlPollFd->poll())
+            controlEventsProcess();
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+
+    controlEventsInvalidate();
+}
+
+/*
+ * Called from the reactor on control events. Stays disarmed on errors.
+ */
+bool Camera::controlEventsHandle()
+{
+    try {
+        controlEventsProcess();
+
+        return true;
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+
+    controlEventsInvalidate();
+
+    return false;
+}
+
+/*
+ * The cache can't be kept coherent anymore, read the HW from now on.
+ */
+void Camera::controlEventsInvalidate()
+{
+    std::lock_guard<std::mutex> lock(mControlLock);
+
+    mControlsSubscribed.clear();
+    mControlValues.clear();
+}
+
+void Camera::controlEventsProcess()
+{
+    while (true) {
+        v4l2_event event {0};
+
+        if (xioctl(VIDIOC_DQEVENT, &event) < 0) {
+            /* No more events. */
+            if (errno == ENOENT)
+                return;
+
+            throw Exception("Failed to call [VIDIOC_DQEVENT] for device " +
+                            mDevPath, errno);
+        }
+
+        if (event.type != V4L2_EVENT_CTRL ||
+            !(event.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE))
+            continue;
+
+        DLOG(mLog, DEBUG) << "Control " << event.id << " changed to " <<
+            event.u.ctrl.value;
+
+        ControlChangeCallback clb;
+
+        {
+            std::lock_guard<std::mutex> lock(mControlLock);
+
+            mControlValues[event.id] = event.u.ctrl.value;
+            clb = mControlChangeCallback;
+        }
+
+        /* The callback may call back into the camera. */
+        if (clb)
+            clb(event.id, event.u.ctrl.value);
+    }
+}
+
+/*
+ ********************************************************************
+ * Capability cache related functionality.
+ ********************************************************************
+ */
+template<typename T>
+static void cacheWrite(std::ostream& stream, const T& value)
+{
+    stream.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void cacheWrite(std::ostream& stream, const std::string& value)
+{
+    cacheWrite(stream, static_cast<uint32_t>(value.size()));
+    stream.write(value.data(), value.size());
+}
+
+template<typename T>
+static bool cacheRead(std::istream& stream, T& value)
+{
+    return static_cast<bool>(stream.read(reinterpret_cast<char *>(&value),
+                                         sizeof(value)));
+}
+
+/* Guard against allocating huge arrays for a corrupted cache. */
+static bool cacheReadCount(std::istream& stream, uint32_t& count)
+{
+    return cacheRead(stream, count) && count <= 1024;
+}
+
+static bool cacheRead(std::istream& stream, std::string& value)
+{
+    uint32_t size;
+
+    if (!cacheReadCount(stream, size))
+        return false;
+
+    value.resize(size);
+
+    return static_cast<bool>(stream.read(&value[0], size));
+}
+
+std::string Camera::capsCacheGetPath()
+{
+    if (gCacheDirName.empty() || mCapsCacheKey.empty())
+        return std::string();
+
+    std::string fileName = mCapsCacheKey;
+
+    std::replace_if(fileName.begin(), fileName.end(), [](char c) {
+                        return !isalnum(c) && c != '-' && c != '.';
+                    }, '_');
+
+    return gCacheDirName + "/" + fileName + ".cache";
+}
+
+bool Camera::capsCacheLoad()
+{
+    auto path = capsCacheGetPath();
+
+    if (path.empty())
+        return false;
+
+    std::ifstream stream(path, std::ios::binary);
+
+    if (!stream)
+        return false;
+
+    std::vector<Format> formats;
+    std::vector<ControlInfo> controls;
+
+    auto readCache = [&]() {
+        uint32_t magic, version, numFormats, numControls;
+        std::string key;
+
+        if (!cacheRead(stream, magic) || magic != cCapsCacheMagic ||
+            !cacheRead(stream, version) || version != cCapsCacheVersion ||
+            !cacheRead(stream, key) || key != mCapsCacheKey ||
+            !cacheReadCount(stream, numFormats))
+            return false;
+
+        for (uint32_t i = 0; i < numFormats; i++) {
+            Format format;
+            uint32_t numSizes;
+
+            if (!cacheRead(stream, format.pixelFormat) ||
+                !cacheRead(stream, format.description) ||
+                !cacheReadCount(stream, numSizes))
+                return false;
+
+            for (uint32_t j = 0; j < numSizes; j++) {
+                FormatSize formatSize;
+                uint32_t numFps;
+
+                if (!cacheRead(stream, formatSize.width) ||
+                    !cacheRead(stream, formatSize.height) ||
+                    !cacheReadCount(stream, numFps))
+                    return false;
+
+                formatSize.fps.resize(numFps);
+
+                for (auto& fps: formatSize.fps)
+                    if (!cacheRead(stream, fps))
+                        return false;
+
+                format.size.push_back(formatSize);
+            }
+
+            formats.push_back(format);
+        }
+
+        if (!cacheReadCount(stream, numControls))
+            return false;
+
+        controls.resize(numControls);
+
+        for (auto& ctrl: controls)
+            if (!cacheRead(stream, ctrl))
+                return false;
+
+        return true;
+    };
+
+    if (!readCache()) {
+        LOG(mLog, WARNING) << "Ignoring invalid capability cache " << path;
+        return false;
+    }
+
+    if (!formatsValidate(formats)) {
+        LOG(mLog, WARNING) << "Ignoring stale capability cache " << path;
+        return false;
+    }
+
+    mFormats = std::move(formats);
+    mControls = std::move(controls);
+    controlIndexBuild();
+    mControlsValidated.clear();
+    mCapsCached = true;
+
+    LOG(mLog, DEBUG) << "Loaded capabilities of " << mDevPath <<
+        " from cache " << path;
+
+    return true;
+}
+
+void Camera::capsCacheStore()
 {
-    auto ctrl = controlEnum(name);
+    auto path = capsCacheGetPath();
+
+    if (path.empty())
+        return;
+
+    /*
+     * Write to a temporary file first, so other instances never see
+     * a partially written cache.
+     */
+    auto tmpPath = path + "." + std::to_string(getpid());
+
+    {
+        std::ofstream stream(tmpPath, std::ios::binary | std::ios::trunc);
+
+        cacheWrite(stream, cCapsCacheMagic);
+        cacheWrite(stream, cCapsCacheVersion);
+        cacheWrite(stream, mCapsCacheKey);
+
+        cacheWrite(stream, static_cast<uint32_t>(mFormats.size()));
+
+        for (auto const& format: mFormats) {
+            cacheWrite(stream, format.pixelFormat);
+            cacheWrite(stream, format.description);
+            cacheWrite(stream, static_cast<uint32_t>(format.size.size()));
+
+            for (auto const& formatSize: format.size) {
+                cacheWrite(stream, formatSize.width);
+                cacheWrite(stream, formatSize.height);
+                cacheWrite(stream, static_cast<uint32_t>(formatSize.fps.size()));
+
+                for (auto const& fps: formatSize.fps)
+                    cacheWrite(stream, fps);
+            }
+        }
 
-    return controlGetValue(ctrl.v4l2_cid);
+        cacheWrite(stream, static_cast<uint32_t>(mControls.size()));
+
+        for (auto const& ctrl: mControls)
+            cacheWrite(stream, ctrl);
+
+        stream.close();
+
+        if (!stream) {
+            LOG(mLog, WARNING) << "Failed to write capability cache " <<
+                tmpPath;
+            unlink(tmpPath.c_str());
+            return;
+        }
+    }
+
+    if (rename(tmpPath.c_str(), path.c_str()) < 0) {
+        LOG(mLog, WARNING) << "Failed to store capability cache " << path <<
+            ": " << strerror(errno);
+        unlink(tmpPath.c_str());
+        return;
+    }
+
+    LOG(mLog, DEBUG) << "Stored capabilities of " << mDevPath <<
+        " to cache " << path;
 }
 
+void Camera::capsCacheRefresh()
+{
+    LOG(mLog, WARNING) << "Capability cache is stale for device " <<
+        mDevPath << ", enumerating";
+
+    mCapsCached = false;
+
+    formatEnumerate();
+    controlEnumerate();
+    capsCacheStore();
+
+    /* The controls may have changed, so do their event subscriptions. */
+    controlSubscribe();
+}
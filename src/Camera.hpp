@@ -8,21 +8,35 @@
 #ifndef SRC_CAMERA_HPP_
 #define SRC_CAMERA_HPP_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <list>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <linux/videodev2.h>
 
 #include <xen/be/Log.hpp>
 #include <xen/be/Utils.hpp>
 
+#include "Reactor.hpp"
+#include "ThreadConfig.hpp"
+
 class Camera
 {
 public:
-    Camera(const std::string devName);
+    /*
+     * With the reactor the frames, control events and the watchdog of the
+     * camera are waited for by the shared reactor threads instead of the
+     * own threads of the camera.
+     */
+    Camera(const std::string devName, ReactorPtr reactor = nullptr);
     ~Camera();
 
     const std::string getDevPath() const {
@@ -41,15 +55,55 @@ public:
     int bufferGetMin();
     int bufferExport(int index);
     void *bufferGetData(int index);
-
-    /* Stream related functionlity. */
-    typedef std::function<void(int, int)> FrameDoneCallback;
+    size_t bufferGetSize(int index);
+
+    /*
+     * A dequeued buffer is held while the frame done callback runs, the
+     * callback may take more holds, e.g. for the frontends which read the
+     * frame in place. The buffer is queued back when the last hold is
+     * released. Held buffers are not queued when the stream is restarted.
+     */
+    void bufferHold(int index);
+    void bufferRelease(int index);
+
+    /*
+     * Stream related functionlity.
+     * Frame done callback returns true if the frame has been consumed.
+     */
+    typedef std::function<bool(int, int)> FrameDoneCallback;
 
     int streamAlloc(int numBuffers);
     void streamRelease();
     void streamStart(FrameDoneCallback clb);
     void streamStop();
 
+    /*
+     * Pause the stream if no frame has been consumed for the idle timeout,
+     * but not sooner than the hysteresis time after the stream has been
+     * (re)started. Zero timeout disables pausing.
+     */
+    void streamSetIdlePolicy(std::chrono::milliseconds timeout,
+                             std::chrono::milliseconds hysteresis);
+    /* Resume the stream if it has been paused. */
+    void streamWake();
+
+    /*
+     * Restart the stream if no frames have been captured for the given
+     * number of frame intervals. Zero disables the watchdog.
+     */
+    void streamSetWatchdog(int numFrames);
+
+    /* Placement and scheduling of the capture thread. */
+    void streamSetThreadConfig(const ThreadConfig& threadConfig);
+
+    /*
+     * Sleep until the given time before the next frame is expected, then
+     * spin on dequeueing it, for at most twice that time. Frames which come
+     * late are waited for the usual way. Zero disables busy polling.
+     * Only used with the own thread of the camera.
+     */
+    void streamSetBusyPoll(std::chrono::microseconds window);
+
     /* Format related functionality. */
     void formatSet(uint32_t width, uint32_t height, uint32_t pixelFormat);
     void formatSet(v4l2_format fmt);
@@ -59,6 +113,21 @@ public:
     /* Frame rate related functionality. */
     void frameRateSet(int num, int denom);
     v4l2_fract frameRateGet();
+    /* Time per frame, the default one if the device does not tell. */
+    std::chrono::microseconds frameIntervalGet();
+
+    /*
+     * Frame rate is frames per second, the interval is its inverse.
+     * Zero if the rate is not known.
+     */
+    static std::chrono::microseconds toFrameInterval(
+        const v4l2_fract &frameRate) {
+        if (!frameRate.numerator || !frameRate.denominator)
+            return std::chrono::microseconds(0);
+
+        return std::chrono::microseconds(
+            1000000ll * frameRate.denominator / frameRate.numerator);
+    }
 
     /* Control related functionality. */
     struct ControlInfo {
@@ -70,9 +139,25 @@ public:
         signed int step;
     };
 
-    ControlInfo controlEnum(std::string name);
-    void controlSetValue(std::string name, signed int value);
-    signed int controlGetValue(std::string name);
+    struct ControlValue {
+        int v4l2_cid;
+        signed int value;
+    };
+
+    ControlInfo controlEnum(int v4l2_cid);
+    signed int controlGetValue(int v4l2_cid);
+    /* All the values are applied atomically, on the same frame. */
+    void controlSetValues(const std::vector<ControlValue>& values);
+
+    /* v4l2_cid, value: control has been changed not by this camera. */
+    typedef std::function<void(int, signed int)> ControlChangeCallback;
+
+    void controlSetChangeCallback(ControlChangeCallback clb);
+    /*
+     * Stop the control events, waiting for the callback in progress
+     * if any. Cached control values are not used from then on.
+     */
+    void controlEventsStop();
 
     bool isFieldInterlaced() { return mFieldInterlaced; }
 
@@ -92,15 +177,82 @@ protected:
 
     std::unique_ptr<XenBackend::PollFd> mPollFd;
 
+    ReactorPtr mReactor;
+    ThreadConfig mThreadConfig;
+
     FrameDoneCallback mFrameDoneCallback;
 
     struct Buffer {
         size_t size;
         void *data;
+        int holds;
     };
 
     std::vector<Buffer> mBuffers;
 
+    /*
+     * Stopping the stream dequeues all the buffers, so they need to
+     * be queued again if the stream is restarted with the same buffers.
+     * Protected, with the buffer holds, by mBufferLock.
+     */
+    bool mBuffersQueued;
+    std::mutex mBufferLock;
+
+    /* Idle policy related. */
+    std::chrono::milliseconds mIdleTimeout;
+    std::chrono::milliseconds mIdleHysteresis;
+    std::chrono::steady_clock::time_point mStreamOnTime;
+    std::chrono::steady_clock::time_point mLastConsumedTime;
+
+    std::mutex mPauseLock;
+    std::condition_variable mPauseCondition;
+    bool mPaused;
+    bool mWakeRequested;
+    bool mStopRequested;
+
+    /*
+     * Stream recovery related: capture errors restart the stream in place
+     * with exponential back-off, the watchdog restarts stalled stream.
+     */
+    static const int cMaxRecoveries = 5;
+    const std::chrono::milliseconds cRecoveryBackoff =
+        std::chrono::milliseconds(10);
+    const std::chrono::milliseconds cDefaultFrameInterval =
+        std::chrono::milliseconds(33);
+
+    int mRecoveries;
+    /* Timer of the recovery back-off with the reactor. */
+    int mRecoverFd;
+    std::atomic<std::chrono::steady_clock::rep> mLastFrameTime;
+
+    int mWatchdogFrames;
+    std::chrono::milliseconds mWatchdogTimeout;
+    std::condition_variable mWatchdogCondition;
+    std::thread mWatchdogThread;
+    bool mWatchdogTerminate;
+    /* Timer of the watchdog with the reactor. */
+    int mWatchdogFd;
+
+    /*
+     * Busy polling related: the next frame is expected one frame interval,
+     * estimated from the recent buffer timestamps, after the previous one.
+     * Dequeue latency, from the buffer timestamp to the frame being
+     * dequeued, is accounted separately for busy polled and waited frames
+     * and reported when the stream stops.
+     */
+    std::chrono::microseconds mBusyPollWindow;
+    std::chrono::microseconds mFrameIntervalEst;
+    std::chrono::steady_clock::time_point mLastTimestamp;
+    std::chrono::steady_clock::time_point mNextFrameTime;
+
+    struct BusyPollStats {
+        uint64_t polledFrames;
+        uint64_t waitedFrames;
+        uint64_t lateFrames;
+        std::chrono::nanoseconds polledLatency;
+        std::chrono::nanoseconds waitedLatency;
+    } mBusyPollStats;
+
     void init();
     void release();
 
@@ -130,6 +282,7 @@ protected:
     bool mFieldInterlaced;
 
     void formatEnumerate();
+    bool formatsValidate(const std::vector<Format>& formats);
 
     /* Frame size related functionality. */
     int frameSizeGet(int index, uint32_t pixelFormat,
@@ -143,12 +296,84 @@ protected:
         return static_cast<float>(fract.denominator) / fract.numerator;
     }
 
+    /* Rewritten under mControlLock when the capability cache is stale. */
     std::vector<ControlInfo> mControls;
+    /* v4l2_cid to index in mControls. */
+    std::unordered_map<int, size_t> mControlIndex;
 
     void controlEnumerate();
-    signed int controlGetValue(int v4l2_cid);
+    void controlIndexBuild();
+    bool controlFind(int v4l2_cid, ControlInfo& info);
+    bool controlValidate(const ControlInfo& ctrl);
+
+    /*
+     * Control values cache: values of the controls subscribed to control
+     * events are kept coherent with the HW by the control event thread.
+     * The capture thread only runs while streaming, so control events are
+     * polled on their own.
+     */
+    std::mutex mControlLock;
+    std::unordered_set<int> mControlsSubscribed;
+    std::unordered_map<int, signed int> mControlValues;
+    ControlChangeCallback mControlChangeCallback;
+
+    std::unique_ptr<XenBackend::PollFd> mControlPollFd;
+    std::thread mControlThread;
+    /*
+     * Duplicate of the device descriptor for the reactor, which can't have
+     * two handlers for the frame and control events of one descriptor.
+     */
+    int mControlFd;
+
+    void controlSubscribe();
+    void controlEventThread();
+    bool controlEventsHandle();
+    void controlEventsProcess();
+    void controlEventsInvalidate();
+
+    /*
+     * Capability cache related functionality: formats and controls
+     * enumerated for the device are stored in a file keyed by
+     * driver, card, bus info and driver version, so later opens of
+     * the same device can skip the enumeration.
+     */
+    static const uint32_t cCapsCacheMagic = 0x43424543;
+    static const uint32_t cCapsCacheVersion = 1;
+
+    std::string mCapsCacheKey;
+    bool mCapsCached;
+    std::vector<int> mControlsValidated;
+
+    std::string capsCacheGetPath();
+    bool capsCacheLoad();
+    void capsCacheStore();
+    void capsCacheRefresh();
+
+    int bufferTryDequeue(v4l2_buffer& buf);
 
     void eventThread();
+    bool eventProcess();
+    bool frameProcess(const v4l2_buffer& buf, bool polled);
+    int busyPoll();
+    void busyPollReport();
+    void eventThreadStart();
+    void eventThreadStop();
+    bool eventThreadWait(std::chrono::microseconds time);
+
+    void streamOn();
+    void streamOff();
+    bool streamRecover();
+    bool recoverSchedule();
+    bool recoverProcess();
+    bool streamIsIdle();
+    bool streamPause();
+
+    void watchdogStart();
+    void watchdogStop();
+    void watchdogThread();
+    bool watchdogProcess();
+    bool watchdogExpired();
+    void watchdogRestart();
 };
 
 typedef std::shared_ptr<Camera> CameraPtr;
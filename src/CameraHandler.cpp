@@ -7,7 +7,10 @@
  * Copyright (C) 2018-2019 EPAM Systems Inc.
  */
 
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
 #include <iomanip>
 
 #include <xen/be/Exception.hpp>
@@ -18,11 +21,36 @@
 using namespace std::placeholders;
 using XenBackend::Exception;
 
-extern std::string gCfgFileName;
-static int dom_cnt;
-
-CameraHandler::CameraHandler(std::string uniqueId) :
-    mLog("CameraHandler")
+const int CameraHandler::BE_CONFIG_NUM_BUFFERS;
+const int CameraHandler::cQuotaFrameBurst;
+
+/* Handlers of different cameras are constructed concurrently. */
+static std::atomic<int> dom_cnt(0);
+
+CameraHandler::CameraHandler(std::string uniqueId, ConfigPtr config,
+                             ReactorPtr reactor, ExecutorPtr executor) :
+    mLog("CameraHandler"),
+    mConfig(config),
+    mReactor(reactor),
+    mExecutor(executor),
+    mHasConfig(false),
+    mHasFrameRate(false),
+    mStreaming(false),
+    mStreamStopping(false),
+    mLingerTime(config->getBackendConfig().lingerMs),
+    mLingerStream(config->getBackendConfig().lingerStream),
+    mLingering(false),
+    mTerminate(false),
+    mFrameHolds(1, BE_CONFIG_NUM_BUFFERS - 1),
+    mCtrlEventInterval(config->getBackendConfig().ctrlEventIntervalMs),
+    mFrameInterval(33333),
+    mFrameData(nullptr),
+    mFrameSize(0),
+    mFrameTask([this](size_t i) {
+        auto& target = mFrameTargets[i];
+
+        target.delivered = (*target.listener)(mFrameData, mFrameSize);
+    })
 {
     LOG(mLog, DEBUG) << "Create camera handler";
 
@@ -57,8 +85,10 @@ void CameraHandler::init(std::string uniqueId)
 {
     mFormatSet = false;
     mFramerateSet = false;
+    mNumBuffersAllocated = 0;
     mBuffersAllocated.clear();
     mStreamingNow.clear();
+    mLastFrameIndex = -1;
 
     /*
      * Determine whether the media pipeline needs to be configured the first for
@@ -66,20 +96,37 @@ void CameraHandler::init(std::string uniqueId)
      * unique-id = video-id[:media-id]
      * where the "media-id" field is optional and should begin with ":"
      */
-    std::string videoId, mediaId;
-    parseUniqueId(uniqueId, videoId, mediaId);
+    parseUniqueId(uniqueId, mVideoId, mMediaId);
+
+    mCameraConfig = mConfig->getCameraConfig(mVideoId);
+
+    cameraAttach();
+}
 
-    if (!mediaId.empty()) {
+void CameraHandler::cameraAttach()
+{
+    if (!mMediaId.empty()) {
         LOG(mLog, DEBUG) << "media-id is not empty, media pipeline needs to be configured";
 
-        ConfigPtr config(new Config(gCfgFileName));
-        mMediaController = MediaControllerPtr(new MediaController(mediaId, config));
+        mMediaController = MediaControllerPtr(new MediaController(mMediaId,
+                                                                  mVideoId,
+                                                                  mConfig));
     }
 
-    if (!videoId.empty())
-        mCamera.reset(new Camera(videoId));
+    if (!mVideoId.empty())
+        mCamera.reset(new Camera(mVideoId, mReactor));
     else
         throw Exception("video-id is empty", EINVAL);
+
+    mCamera->streamSetIdlePolicy(
+        std::chrono::milliseconds(mCameraConfig.idleTimeoutMs),
+        std::chrono::milliseconds(mCameraConfig.idleHysteresisMs));
+    mCamera->streamSetWatchdog(mCameraConfig.watchdogFrames);
+    mCamera->streamSetThreadConfig(mCameraConfig.thread);
+    mCamera->streamSetBusyPoll(
+        std::chrono::microseconds(mCameraConfig.busyPollUs));
+    mCamera->controlSetChangeCallback(bind(&CameraHandler::onCtrlChangeCallback,
+                                           this, _1, _2));
 }
 
 void CameraHandler::parseUniqueId(const std::string& uniqueId,
@@ -111,13 +158,159 @@ void CameraHandler::listenerSet(domid_t domId, Listeners listeners)
     std::lock_guard<std::mutex> lock(mLock);
 
     mListeners.emplace(domId, listeners);
+    mFrameTargets.reserve(mListeners.size());
+
+    quotaSet(domId);
 }
 
 void CameraHandler::listenerReset(domid_t domId)
 {
-    std::lock_guard<std::mutex> lock(mLock);
+    std::unique_lock<std::mutex> lock(mLock);
+
+    quotaReport(domId);
+    frameReleaseAll(domId);
 
     mListeners.erase(domId);
+    mCtrlEvents.erase(domId);
+    mQuotas.erase(domId);
+
+    /*
+     * The frontend may go away without stopping the stream or
+     * releasing its buffers, so do it on its behalf.
+     */
+    mStreamingNow.erase(domId);
+    mBuffersAllocated.erase(domId);
+
+    if (mCamera)
+        releaseUnused(lock, true);
+}
+
+void CameraHandler::deviceAttach()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    if (mCamera || mTerminate)
+        return;
+
+    LOG(mLog, INFO) << "Camera " << mVideoId << " has appeared, attach";
+
+    try {
+        cameraAttach();
+        cameraRestore(lock);
+    } catch (const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+        LOG(mLog, ERROR) << "Camera attach failed, run without hardware.";
+
+        auto camera = std::move(mCamera);
+        auto mediaController = std::move(mMediaController);
+
+        mNumBuffersAllocated = 0;
+        mStreaming = false;
+        exportedRelease();
+
+        /*
+         * The camera threads call back into the handler, so the camera
+         * is deleted out of the lock.
+         */
+        lock.unlock();
+
+        if (camera) {
+            camera->streamStop();
+            camera->streamRelease();
+        }
+    }
+}
+
+/*
+ * Bring the camera to the state the frontends expect: the format and
+ * the frame rate they have set, buffers for those which have requested
+ * them and the stream for those which are streaming.
+ */
+void CameraHandler::cameraRestore(std::unique_lock<std::mutex>& lock)
+{
+    if (mHasConfig) {
+        v4l2_format fmt {0};
+
+        if (mCamera->isFieldInterlaced())
+            fmt.fmt.pix.field = V4L2_FIELD_INTERLACED;
+        fmt.fmt.pix.pixelformat = mConfigReq.pixel_format;
+        fmt.fmt.pix.width = mConfigReq.width;
+        fmt.fmt.pix.height = mConfigReq.height;
+
+        mCamera->formatSet(fmt);
+    }
+
+    if (mHasFrameRate)
+        mCamera->frameRateSet(mFrameRateReq.frame_rate_numer,
+                              mFrameRateReq.frame_rate_denom);
+
+    if (!mBuffersAllocated.empty())
+        mNumBuffersAllocated = mCamera->streamAlloc(BE_CONFIG_NUM_BUFFERS);
+
+    if (isStreamNeeded())
+        cameraStreamStart(lock);
+}
+
+void CameraHandler::deviceDetach()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    if (!mCamera)
+        return;
+
+    LOG(mLog, INFO) << "Camera " << mVideoId << " has gone, detach";
+
+    /*
+     * Domains' state is kept, so streaming is resumed when the camera
+     * is back.
+     */
+    cameraStreamStop(lock);
+
+    cameraBuffersRelease();
+    mLingering = false;
+
+    auto camera = std::move(mCamera);
+    auto mediaController = std::move(mMediaController);
+
+    /*
+     * The camera threads call back into the handler, so the camera
+     * is deleted out of the lock.
+     */
+    lock.unlock();
+}
+
+void CameraHandler::reloadConfig(ConfigPtr config)
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    mConfig = config;
+
+    for (auto &listener : mListeners)
+        quotaSet(listener.first);
+
+    if (!mMediaController || mMediaController->pipelineMatches(config))
+        return;
+
+    LOG(mLog, INFO) << "Media pipeline of camera " << mVideoId <<
+        " has changed, reconfigure";
+
+    /* Links can't be changed while streaming. */
+    bool streaming = mStreaming;
+
+    if (streaming)
+        cameraStreamStop(lock);
+
+    if (!mMediaController)
+        return;
+
+    try {
+        mMediaController->reconfigure(config);
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+
+    if (streaming && mCamera && isStreamNeeded())
+        cameraStreamStart(lock);
 }
 
 void CameraHandler::configToXen(xencamera_config_resp *cfg_resp)
@@ -190,20 +383,48 @@ void CameraHandler::configSetTry(const xencamera_req& aReq,
     }
 }
 
+bool CameraHandler::configMatches(const xencamera_req& aReq)
+{
+    const xencamera_config_req *cfg_req = &aReq.req.config;
+
+    v4l2_format fmt = mCamera->formatGet();
+
+    return fmt.fmt.pix.pixelformat == cfg_req->pixel_format &&
+        fmt.fmt.pix.width == cfg_req->width &&
+        fmt.fmt.pix.height == cfg_req->height;
+}
+
 void CameraHandler::configSet(domid_t domId, const xencamera_req& aReq,
                               xencamera_resp& aResp)
 {
-    std::lock_guard<std::mutex> lock(mLock);
+    std::unique_lock<std::mutex> lock(mLock);
 
     DLOG(mLog, DEBUG) << "Handle command [CONFIG SET] dom " <<
         std::to_string(domId);
 
     if (mFormatSet) {
         configToXen(&aResp.resp.config);
+    } else if (mCamera && (mNumBuffersAllocated || mStreaming) &&
+               configMatches(aReq)) {
+        /*
+         * The format is already set and the buffers are allocated for it,
+         * e.g. they are kept after the previous frontend has gone.
+         */
+        configToXen(&aResp.resp.config);
     } else {
+        /*
+         * Buffers or stream which are kept, but not used anymore, would
+         * prevent the format from being changed: release them now.
+         */
+        if (mCamera)
+            releaseUnused(lock, false);
+
         configSetTry(aReq, aResp, true);
         if (dom_cnt > 1)
             mFormatSet = true;
+
+        mConfigReq = aReq.req.config;
+        mHasConfig = true;
     }
 }
 
@@ -235,11 +456,7 @@ void CameraHandler::configGet(domid_t domId, const xencamera_req& aReq,
 void CameraHandler::frameRateSet(domid_t domId, const xencamera_req& aReq,
                                  xencamera_resp& aResp)
 {
-    if (!mCamera) {
-        return;
-    }
-
-    std::lock_guard<std::mutex> lock(mLock);
+    std::unique_lock<std::mutex> lock(mLock);
     const xencamera_frame_rate_req *req = &aReq.req.frame_rate;
 
     DLOG(mLog, DEBUG) << "Handle command [FRAME RATE SET] dom " <<
@@ -247,6 +464,13 @@ void CameraHandler::frameRateSet(domid_t domId, const xencamera_req& aReq,
 
     if (mFramerateSet) {
     } else {
+        mFrameRateReq = *req;
+        mHasFrameRate = true;
+
+        if (!mCamera)
+            return;
+
+        releaseUnused(lock, false);
         mCamera->frameRateSet(req->frame_rate_numer, req->frame_rate_denom);
         mFramerateSet = true;
     }
@@ -255,13 +479,13 @@ void CameraHandler::frameRateSet(domid_t domId, const xencamera_req& aReq,
 void CameraHandler::bufGetLayout(domid_t domId, const xencamera_req& aReq,
                                  xencamera_resp& aResp)
 {
+    std::lock_guard<std::mutex> lock(mLock);
+    xencamera_buf_get_layout_resp *resp = &aResp.resp.buf_layout;
+
     if (!mCamera) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(mLock);
-    xencamera_buf_get_layout_resp *resp = &aResp.resp.buf_layout;
-
     DLOG(mLog, DEBUG) << "Handle command [BUF GET LAYOUT] dom " <<
         std::to_string(domId);
 
@@ -279,12 +503,12 @@ void CameraHandler::bufGetLayout(domid_t domId, const xencamera_req& aReq,
 
 size_t CameraHandler::bufGetImageSize(domid_t domId)
 {
+    std::lock_guard<std::mutex> lock(mLock);
+
     if (!mCamera) {
         return 0;
     }
 
-    std::lock_guard<std::mutex> lock(mLock);
-
     v4l2_format fmt = mCamera->formatGet();
 
     return fmt.fmt.pix.sizeimage;
@@ -293,6 +517,8 @@ size_t CameraHandler::bufGetImageSize(domid_t domId)
 void CameraHandler::ctrlEnum(domid_t domId, const xencamera_req& aReq,
                              xencamera_resp& aResp,std::string name)
 {
+    std::lock_guard<std::mutex> lock(mLock);
+
     if (!mCamera) {
         /*
          * The zeroed "successful" response won't pass sanity check of passed
@@ -307,7 +533,8 @@ void CameraHandler::ctrlEnum(domid_t domId, const xencamera_req& aReq,
     const xencamera_index *req = &aReq.req.index;
     xencamera_ctrl_enum_resp *resp = &aResp.resp.ctrl_enum;
 
-    auto info = mCamera->controlEnum(name);
+    auto info = mCamera->controlEnum(
+        V4L2ToXen::ctrlToV4L2(V4L2ToXen::ctrlGetTypeXen(name)));
 
     resp->index = req->index;
     resp->type = V4L2ToXen::ctrlToXen(info.v4l2_cid);
@@ -318,15 +545,15 @@ void CameraHandler::ctrlEnum(domid_t domId, const xencamera_req& aReq,
     resp->def_val = info.default_value;
 }
 
-void CameraHandler::ctrlSet(domid_t domId, const xencamera_req& aReq,
-                            xencamera_resp& aResp, std::string name)
+void CameraHandler::ctrlSetValues(domid_t domId,
+                                  const std::vector<Camera::ControlValue>& values)
 {
+    std::lock_guard<std::mutex> lock(mLock);
+
     if (!mCamera) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(mLock);
-
     /*
      * FIXME: for V4L2 frontends there could be a circular depependecy
      * here: when a frontend recievs "control changed" event it will
@@ -339,55 +566,568 @@ void CameraHandler::ctrlSet(domid_t domId, const xencamera_req& aReq,
      * has control's value different from the current and only send
      * events if so.
      */
-    auto curVal = mCamera->controlGetValue(name);
-
-    DLOG(mLog, DEBUG) << "Handle command [SET CTRL] dom " <<
-        std::to_string(domId) << " control " << name << " current: " <<
-        std::to_string(curVal) << " requested: " <<
-        std::to_string(aReq.req.ctrl_value.value);
-
-    if (curVal == aReq.req.ctrl_value.value) {
-        DLOG(mLog, DEBUG) << "Skip command [SET CTRL] dom " <<
-            std::to_string(domId) << " control " << name << " current: " <<
-            std::to_string(curVal) << " requested: " <<
-            std::to_string(aReq.req.ctrl_value.value);
-        return;
+    std::vector<Camera::ControlValue> changed;
+
+    for (auto const& ctrl : values) {
+        auto curVal = mCamera->controlGetValue(ctrl.v4l2_cid);
+
+        if (curVal == ctrl.value) {
+            DLOG(mLog, DEBUG) << "Skip command [SET CTRL] dom " <<
+                std::to_string(domId) << " control " << ctrl.v4l2_cid <<
+                " current: " << std::to_string(curVal);
+            continue;
+        }
+
+        changed.push_back(ctrl);
     }
 
-    mCamera->controlSetValue(name, aReq.req.ctrl_value.value);
+    if (changed.empty())
+        return;
+
+    mCamera->controlSetValues(changed);
 
     /* Send ctrl change event to the rest of frontends, but current. */
-    for (auto &listener : mListeners) {
-        if (listener.first != domId)
-            listener.second.control(name, aReq.req.ctrl_value.value);
+    for (auto const& ctrl : changed) {
+        auto name = V4L2ToXen::ctrlGetNameV4L2(ctrl.v4l2_cid);
+
+        for (auto &listener : mListeners) {
+            if (listener.first != domId)
+                ctrlEventNotify(listener.first, name, ctrl.value);
+        }
     }
+
+    ctrlEventFlush();
 }
 
-void CameraHandler::onFrameDoneCallback(int index, int size)
+bool CameraHandler::onFrameDoneCallback(int index, int size)
 {
+    std::lock_guard<std::mutex> lock(mLock);
+
     if (!mCamera) {
+        return false;
+    }
+
+    auto data = mCamera->bufferGetData(index);
+
+    DLOG(mLog, DEBUG) << "Frame " << index << " backend index " << index;
+
+    bool consumed = frameDeliver(index, static_cast<uint8_t *>(data), size);
+
+    /* The frontends sharing the buffers may hold all the spare ones. */
+    if (mCameraConfig.speculativeStart && mBuffersShared.empty())
+        lastFrameKeep(index, size);
+
+    return consumed;
+}
+
+/*
+ * Index is that of the camera buffer the frame is in, -1 if the frame is
+ * a copy: then it is not delivered to the frontends sharing the buffers.
+ * Must be called with mLock held.
+ */
+bool CameraHandler::frameDeliver(int index, uint8_t *data, size_t size)
+{
+    /*
+     * The camera may stream while some frontends have not started
+     * streaming yet, e.g. on speculative start: only deliver the frame
+     * to those which have.
+     */
+    mFrameTargets.clear();
+
+    auto now = std::chrono::steady_clock::now();
+    bool consumed = false;
+
+    for (auto &listener : mListeners) {
+        if (mStreamingNow.find(listener.first) == mStreamingNow.end())
+            continue;
+
+        /* Sharing the buffer costs no copy, so it is done right here. */
+        if (listener.second.shared) {
+            if (index >= 0 && mBuffersShared.count(listener.first) &&
+                quotaCheck(listener.first, size, now) &&
+                frameShare(listener.first, listener.second.shared,
+                           index, size)) {
+                quotaCharge(listener.first, size);
+                consumed = true;
+            }
+            continue;
+        }
+
+        if (quotaCheck(listener.first, size, now))
+            mFrameTargets.push_back({
+                .domId = listener.first,
+                .listener = &listener.second.frame,
+                .delivered = false
+            });
+    }
+
+    /* Not worth the hand-off for a single frontend. */
+    if (!mExecutor || mFrameTargets.size() < 2) {
+        for (auto& target : mFrameTargets)
+            target.delivered = (*target.listener)(data, size);
+    } else {
+        mFrameData = data;
+        mFrameSize = size;
+
+        auto skipped = mExecutor->run(mFrameTargets.size(), mFrameTask,
+                                      std::chrono::steady_clock::now() +
+                                      mFrameInterval);
+
+        if (skipped)
+            DLOG(mLog, WARNING) << "Frame dropped for " << skipped <<
+                " frontends, deadline missed";
+    }
+
+    /* E.g. no buffer queued by the frontend: the frame costs no quota. */
+    for (auto const& target : mFrameTargets) {
+        if (!target.delivered)
+            continue;
+
+        quotaCharge(target.domId, size);
+        consumed = true;
+    }
+
+    return consumed;
+}
+
+/*
+ * The frontend holds the buffer from the frame event on, so the camera
+ * does not fill it before the frontend has read it.
+ * Must be called with mLock held.
+ */
+/*
+ * The camera buffer with the latest frame is held instead of copying the
+ * frame, the previous one goes back to the camera.
+ * Must be called with mLock held.
+ */
+void CameraHandler::lastFrameKeep(int index, size_t size)
+{
+    if (index != mLastFrameIndex) {
+        mCamera->bufferHold(index);
+        lastFrameRelease();
+    }
+
+    mLastFrameIndex = index;
+    mLastFrameSize = size;
+    mLastFrameTime = std::chrono::steady_clock::now();
+}
+
+/*
+ * Must be called with mLock held.
+ */
+void CameraHandler::lastFrameRelease()
+{
+    if (mLastFrameIndex < 0)
         return;
+
+    int index = mLastFrameIndex;
+
+    mLastFrameIndex = -1;
+
+    if (!mCamera)
+        return;
+
+    try {
+        mCamera->bufferRelease(index);
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+}
+
+/*
+ * A frontend starting to stream on an already running camera gets the
+ * latest frame right away instead of waiting for the next one, unless
+ * it is older than a frame interval: the frame is subject to the quota
+ * as any other.
+ * Must be called with mLock held.
+ */
+void CameraHandler::lastFrameDeliver(domid_t domId)
+{
+    auto listener = mListeners.find(domId);
+
+    if (mLastFrameIndex < 0 || listener == mListeners.end() ||
+        listener->second.shared)
+        return;
+
+    auto now = std::chrono::steady_clock::now();
+
+    if (now - mLastFrameTime > mFrameInterval ||
+        !quotaCheck(domId, mLastFrameSize, now))
+        return;
+
+    auto data = mCamera->bufferGetData(mLastFrameIndex);
+
+    if (listener->second.frame(static_cast<uint8_t *>(data), mLastFrameSize))
+        quotaCharge(domId, mLastFrameSize);
+}
+
+bool CameraHandler::frameShare(domid_t domId,
+                               const SharedFrameListener& listener,
+                               int index, size_t size)
+{
+    /* The frontend still holds this buffer or too many others. */
+    if (!mFrameHolds.hold(domId, index))
+        return false;
+
+    mCamera->bufferHold(index);
+
+    if (listener(index, size))
+        return true;
+
+    mFrameHolds.release(domId, index);
+    mCamera->bufferRelease(index);
+
+    return false;
+}
+
+void CameraHandler::frameRelease(domid_t domId, int index)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    DLOG(mLog, DEBUG) << "Frontend dom " << std::to_string(domId) <<
+        " has released buffer " << index;
+
+    if (!mFrameHolds.release(domId, index))
+        throw Exception("Buffer " + std::to_string(index) +
+                        " is not held by dom " + std::to_string(domId),
+                        EINVAL);
+
+    if (mCamera)
+        mCamera->bufferRelease(index);
+}
+
+/*
+ * The frontend is gone or has stopped streaming.
+ * Must be called with mLock held.
+ */
+void CameraHandler::frameReleaseAll(domid_t domId)
+{
+    for (auto index : mFrameHolds.releaseAll(domId)) {
+        if (!mCamera)
+            continue;
+
+        try {
+            mCamera->bufferRelease(index);
+        } catch(const std::exception& e) {
+            LOG(mLog, ERROR) << e.what();
+        }
     }
+}
 
+std::vector<DmaBuffer> CameraHandler::bufExport(domid_t domId)
+{
     std::lock_guard<std::mutex> lock(mLock);
 
-    auto data = mCamera->bufferGetData(index);
+    if (!mCamera || !mNumBuffersAllocated)
+        throw Exception("No camera buffers to share", ENODEV);
+
+    for (auto const& streaming : mStreamingNow)
+        if (streaming.first != domId)
+            throw Exception("Camera buffers can't be shared with other "
+                            "frontends streaming", EBUSY);
+
+    if (isSharedWithOthers(domId))
+        throw Exception("Camera buffers are shared with another frontend",
+                        EBUSY);
+
+    if (mExportedBuffers.empty()) {
+        try {
+            for (int i = 0; i < mNumBuffersAllocated; i++)
+                mExportedBuffers.push_back({
+                    .fd = mCamera->bufferExport(i),
+                    .size = mCamera->bufferGetSize(i)
+                });
+        } catch(...) {
+            exportedRelease();
+            throw;
+        }
+    }
 
-    DLOG(mLog, DEBUG) << "Frame " << std::to_string(index) <<
-        " backend index " << std::to_string(index);
+    mBuffersShared.insert(domId);
+    lastFrameRelease();
 
-    for (auto &listener : mListeners)
-        listener.second.frame(static_cast<uint8_t *>(data), size);
+    return mExportedBuffers;
 }
 
-void CameraHandler::bufRequest(domid_t domId, const xencamera_req& aReq,
-                               xencamera_resp& aResp)
+/*
+ * Must be called with mLock held.
+ */
+bool CameraHandler::isSharedWithOthers(domid_t domId)
 {
+    return mBuffersShared.size() > 1 ||
+        (!mBuffersShared.empty() && !mBuffersShared.count(domId));
+}
+
+/*
+ * The frontends sharing the buffers keep their access to the old ones
+ * until they stop streaming, but get no frames anymore.
+ * Must be called with mLock held.
+ */
+void CameraHandler::exportedRelease()
+{
+    for (auto const& buffer : mExportedBuffers)
+        ::close(buffer.fd);
+
+    mExportedBuffers.clear();
+    mBuffersShared.clear();
+    mFrameHolds.clear();
+}
+
+/*
+ * Must be called with mLock held.
+ */
+void CameraHandler::cameraBuffersRelease()
+{
+    exportedRelease();
+
+    mCamera->streamRelease();
+    mNumBuffersAllocated = 0;
+}
+
+/*
+ * Must be called with mLock held.
+ */
+bool CameraHandler::quotaCheck(domid_t domId, size_t size,
+                               std::chrono::steady_clock::time_point now)
+{
+    auto it = mQuotas.find(domId);
+
+    if (it == mQuotas.end())
+        return true;
+
+    auto& quota = it->second;
+
+    /* Nothing is taken here, so a throttled frame costs neither quota. */
+    if (quota.frames.check(1, now) && quota.bytes.check(size, now))
+        return true;
+
+    quota.throttledFrames++;
+    quota.throttledBytes += size;
+
+    DLOG(mLog, DEBUG) << "Frame throttled for dom " << domId <<
+        ", throttled frames: " << quota.throttledFrames;
+
+    return false;
+}
+
+/*
+ * Must be called with mLock held.
+ */
+void CameraHandler::quotaSet(domid_t domId)
+{
+    auto domainConfig = mConfig->getDomainConfig(domId);
+
+    if (!domainConfig.maxFps && !domainConfig.maxBytesPerSec) {
+        quotaReport(domId);
+        mQuotas.erase(domId);
+        return;
+    }
+
+    LOG(mLog, INFO) << "Quota of dom " << domId << ": max fps " <<
+        domainConfig.maxFps << ", max bytes per second " <<
+        domainConfig.maxBytesPerSec;
+
+    /*
+     * Two frames of burst: the credit left when a frame passes is kept for
+     * the next ones, with a single frame it would be lost and a rate just
+     * below the camera's would be cut to half of the camera's.
+     */
+    Quota quota {
+        .frames = TokenBucket(domainConfig.maxFps, cQuotaFrameBurst),
+        .bytes = TokenBucket(domainConfig.maxBytesPerSec),
+        .throttledFrames = 0,
+        .throttledBytes = 0,
+    };
+
+    auto it = mQuotas.find(domId);
+
+    /* Keep the counters over configuration reloads. */
+    if (it != mQuotas.end()) {
+        quota.throttledFrames = it->second.throttledFrames;
+        quota.throttledBytes = it->second.throttledBytes;
+    }
+
+    mQuotas[domId] = quota;
+}
+
+/*
+ * Must be called with mLock held.
+ */
+void CameraHandler::quotaReport(domid_t domId)
+{
+    auto it = mQuotas.find(domId);
+
+    if (it == mQuotas.end() || !it->second.throttledFrames)
+        return;
+
+    LOG(mLog, INFO) << "Dom " << domId << " throttled frames: " <<
+        it->second.throttledFrames << ", bytes: " <<
+        it->second.throttledBytes;
+}
+
+/*
+ * Must be called with mLock held.
+ */
+void CameraHandler::quotaCharge(domid_t domId, size_t size)
+{
+    auto it = mQuotas.find(domId);
+
+    if (it == mQuotas.end())
+        return;
+
+    it->second.frames.take(1);
+    it->second.bytes.take(size);
+}
+
+void CameraHandler::ctrlGet(domid_t domId, const xencamera_req& aReq,
+                            xencamera_resp& aResp, std::string name)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
     if (!mCamera) {
         return;
     }
 
+    /* This is served from the control values cache if possible. */
+    auto value = mCamera->controlGetValue(
+        V4L2ToXen::ctrlToV4L2(aReq.req.get_ctrl.type));
+
+    DLOG(mLog, DEBUG) << "Handle command [GET CTRL] dom " <<
+        std::to_string(domId) << " control " << name << " value: " <<
+        std::to_string(value);
+
+    aResp.resp.ctrl_value.type = aReq.req.get_ctrl.type;
+    aResp.resp.ctrl_value.value = value;
+}
+
+/*
+ * Control has been changed not by the backend, e.g. by the HW itself or
+ * by other application: notify all the frontends.
+ */
+void CameraHandler::onCtrlChangeCallback(int v4l2_cid, signed int value)
+{
+    std::string name;
+
+    try {
+        name = V4L2ToXen::ctrlGetNameV4L2(v4l2_cid);
+    } catch(const std::exception& e) {
+        /* Not a control the frontends know of. */
+        return;
+    }
+
     std::lock_guard<std::mutex> lock(mLock);
+
+    DLOG(mLog, DEBUG) << "Control " << name << " changed to " <<
+        std::to_string(value);
+
+    for (auto &listener : mListeners)
+        ctrlEventNotify(listener.first, name, value);
+
+    ctrlEventFlush();
+}
+
+/*
+ * Send control change event to the frontend, unless an event for this
+ * control has been sent within the coalescing interval: then only keep
+ * the value to be sent when the interval expires.
+ */
+void CameraHandler::ctrlEventNotify(domid_t domId, const std::string& name,
+                                    int64_t value)
+{
+    auto listener = mListeners.find(domId);
+
+    if (listener == mListeners.end())
+        return;
+
+    if (!mCtrlEventInterval.count()) {
+        listener->second.control(name, value);
+        return;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    auto& event = mCtrlEvents[domId][name];
+
+    if (event.sentTime + mCtrlEventInterval <= now) {
+        event.sentValue = value;
+        event.sentTime = now;
+        event.pending = false;
+
+        listener->second.control(name, value);
+        return;
+    }
+
+    event.value = value;
+    event.pending = true;
+
+    /* The thread must not be started again once it is being joined. */
+    if (!mCtrlEventThread.joinable() && !mTerminate)
+        mCtrlEventThread = std::thread(&CameraHandler::ctrlEventThread, this);
+
+    mCtrlEventCondition.notify_all();
+}
+
+/*
+ * Control events are only queued by the listeners: let the frontends know
+ * of all of them at once.
+ */
+void CameraHandler::ctrlEventFlush()
+{
+    for (auto &listener : mListeners)
+        if (listener.second.flush)
+            listener.second.flush();
+}
+
+void CameraHandler::ctrlEventThread()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mTerminate) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+
+        for (auto& domain : mCtrlEvents) {
+            auto listener = mListeners.find(domain.first);
+
+            for (auto& entry : domain.second) {
+                auto& event = entry.second;
+
+                if (!event.pending)
+                    continue;
+
+                auto deadline = event.sentTime + mCtrlEventInterval;
+
+                if (deadline > now) {
+                    next = std::min(next, deadline);
+                    continue;
+                }
+
+                event.pending = false;
+
+                /* The value has settled back to what was sent already. */
+                if (event.value == event.sentValue)
+                    continue;
+
+                event.sentValue = event.value;
+                event.sentTime = now;
+
+                if (listener != mListeners.end())
+                    listener->second.control(entry.first, event.value);
+            }
+        }
+
+        ctrlEventFlush();
+
+        if (next == std::chrono::steady_clock::time_point::max())
+            mCtrlEventCondition.wait(lock);
+        else
+            mCtrlEventCondition.wait_until(lock, next);
+    }
+}
+
+void CameraHandler::bufRequest(domid_t domId, const xencamera_req& aReq,
+                               xencamera_resp& aResp)
+{
+    std::unique_lock<std::mutex> lock(mLock);
     const xencamera_buf_request *req = &aReq.req.buf_request;
     xencamera_buf_request *resp = &aResp.resp.buf_request;
 
@@ -395,12 +1135,25 @@ void CameraHandler::bufRequest(domid_t domId, const xencamera_req& aReq,
         std::to_string(domId) << " requested num_bufs " <<
         std::to_string(req->num_bufs);
 
+    if (!mCamera) {
+        /*
+         * Let the frontend have its buffers, so it gets frames as soon
+         * as the camera is attached.
+         */
+        resp->num_bufs = std::min<int>(req->num_bufs, BE_CONFIG_NUM_BUFFERS);
+        mBuffersAllocated.emplace(domId, resp->num_bufs);
+        return;
+    }
+
+    waitStreamStopped(lock);
+
     /*
      * If no buffers are allocated yet in the HW device (backend buffers)
-     * then request buffers now.
+     * then request buffers now. The buffers may still be allocated if
+     * they are kept after the last frontend has released them.
      * This must not be less than max(frontend[i].max_buffers).
      */
-    if (!mBuffersAllocated.size())
+    if (!mNumBuffersAllocated)
         /* TODO: use config for BE_CONFIG_NUM_BUFFERS. */
         mNumBuffersAllocated = mCamera->streamAlloc(BE_CONFIG_NUM_BUFFERS);
 
@@ -411,68 +1164,231 @@ void CameraHandler::bufRequest(domid_t domId, const xencamera_req& aReq,
 
     mBuffersAllocated.emplace(domId, resp->num_bufs);
 
+    /*
+     * Start streaming right away, so the sensor has settled by the time
+     * the frontend starts streaming: frames are dropped until then.
+     */
+    if (mCameraConfig.speculativeStart)
+        cameraStreamStart(lock);
+
     DLOG(mLog, DEBUG) << "Handle command [BUF REQUEST] allowed num_bufs " <<
         std::to_string(resp->num_bufs);
 }
 
 void CameraHandler::bufRelease(domid_t domId)
 {
-    if (!mCamera) {
-        return;
-    }
-
-    std::lock_guard<std::mutex> lock(mLock);
+    std::unique_lock<std::mutex> lock(mLock);
 
     DLOG(mLog, DEBUG) << "Frontend dom " << std::to_string(domId) <<
         " has released all buffers";
 
     mBuffersAllocated.erase(domId);
-    if (!mBuffersAllocated.size())
-        mCamera->streamRelease();
+
+    if (mCamera)
+        releaseUnused(lock, true);
 }
 
-void CameraHandler::streamStart(domid_t domId, const xencamera_req& aReq,
-                                xencamera_resp& aResp)
+void CameraHandler::bufQueued(domid_t domId)
 {
+    std::lock_guard<std::mutex> lock(mLock);
+
     if (!mCamera) {
         return;
     }
 
-    std::lock_guard<std::mutex> lock(mLock);
+    /* The stream might have been paused while nobody had buffers queued. */
+    mCamera->streamWake();
+}
+
+void CameraHandler::streamStart(domid_t domId, const xencamera_req& aReq,
+                                xencamera_resp& aResp)
+{
+    std::unique_lock<std::mutex> lock(mLock);
 
     DLOG(mLog, DEBUG) << "Handle command [STREAM START] dom " <<
         std::to_string(domId);
 
-    if (!mStreamingNow.size())
-        mCamera->streamStart(bind(&CameraHandler::onFrameDoneCallback,
-                                  this, _1, _2));
+    /* Frames would come from the pages that frontend can write. */
+    if (isSharedWithOthers(domId))
+        throw Exception("Camera buffers are shared with another frontend",
+                        EBUSY);
+
+    /* The stream is started when the camera is attached. */
+    if (!mCamera) {
+        mStreamingNow.emplace(domId, true);
+        return;
+    }
+
+    bool running = mStreaming;
+
+    cameraStreamStart(lock);
     mStreamingNow.emplace(domId, true);
+
+    if (running)
+        lastFrameDeliver(domId);
 }
 
 void CameraHandler::streamStop(domid_t domId, const xencamera_req& aReq,
                                xencamera_resp& aResp)
 {
-    if (!mCamera) {
-        return;
-    }
-
     std::unique_lock<std::mutex> lock(mLock);
 
     DLOG(mLog, DEBUG) << "Handle command [STREAM STOP] dom " <<
         std::to_string(domId);
 
     mStreamingNow.erase(domId);
-    if (!mStreamingNow.size()) {
-        lock.unlock();
-        mCamera->streamStop();
+    frameReleaseAll(domId);
+
+    if (mCamera)
+        releaseUnused(lock, true);
+}
+
+/*
+ * Stream is needed while any frontend is streaming or, on speculative
+ * start, while any frontend has buffers allocated.
+ */
+bool CameraHandler::isStreamNeeded()
+{
+    return !mStreamingNow.empty() ||
+        (mCameraConfig.speculativeStart && !mBuffersAllocated.empty());
+}
+
+void CameraHandler::cameraStreamStart(std::unique_lock<std::mutex>& lock)
+{
+    waitStreamStopped(lock);
+
+    if (mStreaming)
+        return;
+
+    mFrameInterval = mCamera->frameIntervalGet();
+
+    mCamera->streamStart(bind(&CameraHandler::onFrameDoneCallback,
+                              this, _1, _2));
+    mStreaming = true;
+}
+
+void CameraHandler::cameraStreamStop(std::unique_lock<std::mutex>& lock)
+{
+    waitStreamStopped(lock);
+
+    if (!mStreaming)
+        return;
+
+    mStreaming = false;
+    mStreamStopping = true;
+    lastFrameRelease();
+
+    /* Let the frame callback complete while the stream is being stopped. */
+    lock.unlock();
+    mCamera->streamStop();
+    lock.lock();
+
+    mStreamStopping = false;
+    mStreamCondition.notify_all();
+}
+
+void CameraHandler::waitStreamStopped(std::unique_lock<std::mutex>& lock)
+{
+    mStreamCondition.wait(lock, [this] { return !mStreamStopping; });
+}
+
+/*
+ * Stop the stream if no frontend is streaming and release the buffers
+ * if no frontend uses them. If linger is requested, then these are kept
+ * for the linger time.
+ */
+void CameraHandler::releaseUnused(std::unique_lock<std::mutex>& lock,
+                                  bool linger)
+{
+    bool lingerEnabled = linger && mLingerTime.count() > 0;
+
+    if (!isStreamNeeded() && !(lingerEnabled && mLingerStream))
+        cameraStreamStop(lock);
+
+    if (!mNumBuffersAllocated || !mBuffersAllocated.empty() || mStreaming) {
+        if (lingerEnabled && mStreaming && !isStreamNeeded())
+            lingerStart();
+        return;
+    }
+
+    if (lingerEnabled) {
+        lingerStart();
+        return;
+    }
+
+    DLOG(mLog, DEBUG) << "Release camera buffers";
+
+    cameraBuffersRelease();
+}
+
+void CameraHandler::lingerStart()
+{
+    DLOG(mLog, DEBUG) << "Keep unused buffers for " <<
+        mLingerTime.count() << " ms";
+
+    mLingerDeadline = std::chrono::steady_clock::now() + mLingerTime;
+    mLingering = true;
+
+    if (!mLingerThread.joinable())
+        mLingerThread = std::thread(&CameraHandler::lingerThread, this);
+
+    mLingerCondition.notify_all();
+}
+
+void CameraHandler::lingerThread()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mTerminate) {
+        if (!mLingering) {
+            mLingerCondition.wait(lock);
+            continue;
+        }
+
+        if (std::chrono::steady_clock::now() < mLingerDeadline) {
+            mLingerCondition.wait_until(lock, mLingerDeadline);
+            continue;
+        }
+
+        DLOG(mLog, DEBUG) << "Linger time expired";
+
+        mLingering = false;
+
+        /* Only releases what is still unused. */
+        releaseUnused(lock, false);
     }
 }
 
 void CameraHandler::release()
 {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mTerminate = true;
+    }
+
+    mLingerCondition.notify_all();
+    mCtrlEventCondition.notify_all();
+
+    if (mLingerThread.joinable())
+        mLingerThread.join();
+
+    /*
+     * The camera outlives the listeners and the control events, which are
+     * destroyed first: make sure no control change comes in from now on.
+     */
+    if (mCamera) {
+        mCamera->controlSetChangeCallback(nullptr);
+        mCamera->controlEventsStop();
+    }
+
+    if (mCtrlEventThread.joinable())
+        mCtrlEventThread.join();
+
     if (mCamera) {
         mCamera->streamStop();
         mCamera->streamRelease();
     }
-}
 
+    exportedRelease();
+}
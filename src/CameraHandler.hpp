@@ -8,8 +8,12 @@
 #ifndef SRC_CAMERAHANDLER_HPP_
 #define SRC_CAMERAHANDLER_HPP_
 
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <xen/be/Log.hpp>
 #include <xen/be/Utils.hpp>
@@ -17,13 +21,20 @@
 #include <xen/io/cameraif.h>
 
 #include "Camera.hpp"
+#include "Config.hpp"
+#include "Executor.hpp"
+#include "FrameHolds.hpp"
 #include "MediaController.hpp"
 #include "FrontendBuffer.hpp"
+#include "SharedBuffers.hpp"
+#include "TokenBucket.hpp"
 
 class CameraHandler
 {
 public:
-    CameraHandler(std::string uniqueId);
+    CameraHandler(std::string uniqueId, ConfigPtr config,
+                  ReactorPtr reactor = nullptr,
+                  ExecutorPtr executor = nullptr);
     ~CameraHandler();
 
     void configToXen(xencamera_config_resp *cfg_resp);
@@ -45,37 +56,88 @@ public:
     void bufRequest(domid_t domId, const xencamera_req& aReq,
                     xencamera_resp& aResp);
     void bufRelease(domid_t domId);
+    void bufQueued(domid_t domId);
     size_t bufGetImageSize(domid_t domId);
 
+    /*
+     * Shared buffers extension: the camera buffers, exported for granting
+     * them to the frontend, and the release of a buffer the frontend has
+     * held since the frame event. Buffers are exported again when the
+     * camera reallocates them, e.g. on re-attach. The buffers are only
+     * shared with a frontend which is alone on the camera, see
+     * mBuffersShared.
+     */
+    std::vector<DmaBuffer> bufExport(domid_t domId);
+    void frameRelease(domid_t domId, int index);
+
     void ctrlEnum(domid_t domId, const xencamera_req& aReq,
                   xencamera_resp& aResp, std::string name);
-    void ctrlSet(domid_t domId, const xencamera_req& aReq,
-                 xencamera_resp& aResp,std::string name);
     void ctrlGet(domid_t domId, const xencamera_req& aReq,
                  xencamera_resp& aResp, std::string name);
+    /* Changed values are set at once, frontends notified once per control. */
+    void ctrlSetValues(domid_t domId,
+                       const std::vector<Camera::ControlValue>& values);
 
     void streamStart(domid_t domId, const xencamera_req& aReq,
                      xencamera_resp& aResp);
     void streamStop(domid_t domId, const xencamera_req& aReq,
                     xencamera_resp& aResp);
 
-    /* data, size */
-    typedef std::function<void(uint8_t *, size_t)> FrameListener;
-    /* name, value */
-    typedef std::function<void(const std::string, int64_t)> ControlListener;
+    /* data, size; returns true if the frame has been consumed */
+    typedef std::function<bool(uint8_t *, size_t)> FrameListener;
+    /*
+     * Camera buffer index, size; the frame is read in place and the buffer
+     * is held until released, returns true if the frame has been consumed.
+     */
+    typedef std::function<bool(int, size_t)> SharedFrameListener;
+    /* name, value; events may be held until flushed */
+    typedef std::function<void(const std::string&, int64_t)> ControlListener;
+    typedef std::function<void()> FlushListener;
 
+    /* Frames go to the shared listener instead, if it is set. */
     struct Listeners {
         FrameListener frame;
         ControlListener control;
+        FlushListener flush;
+        SharedFrameListener shared;
     };
 
     void listenerSet(domid_t domId, Listeners listeners);
     void listenerReset(domid_t domId);
 
+    const std::string& getVideoId() const {
+        return mVideoId;
+    }
+
+    /*
+     * Camera device node has appeared or disappeared: (re)attach the
+     * camera and resume streaming for the frontends which wait for it,
+     * or detach the camera and run without hardware until it is back.
+     */
+    void deviceAttach();
+    void deviceDetach();
+
+    /*
+     * Configuration has been reloaded: reconfigure the media pipeline
+     * if it has changed. Other settings apply to new handlers only.
+     */
+    void reloadConfig(ConfigPtr config);
+
 private:
+    /* Counts the allocations of the frame path. */
+    friend class FrameAllocTest;
+
     XenBackend::Log mLog;
     std::mutex mLock;
 
+    ConfigPtr mConfig;
+    Config::CameraConfig mCameraConfig;
+    ReactorPtr mReactor;
+    ExecutorPtr mExecutor;
+
+    std::string mVideoId;
+    std::string mMediaId;
+
     CameraPtr mCamera;
     MediaControllerPtr mMediaController;
 
@@ -105,15 +167,156 @@ private:
     std::unordered_map<domid_t, int> mBuffersAllocated;
     std::unordered_map<domid_t, bool> mStreamingNow;
 
+    /*
+     * Configuration requested by the frontends, so it can be restored
+     * when the camera is (re)attached.
+     */
+    bool mHasConfig;
+    xencamera_config_req mConfigReq;
+    bool mHasFrameRate;
+    xencamera_frame_rate_req mFrameRateReq;
+
+    /*
+     * Camera streaming state: the lock is released while the camera
+     * stream is being stopped, so the frame callback can complete.
+     */
+    bool mStreaming;
+    bool mStreamStopping;
+    std::condition_variable mStreamCondition;
+
+    /*
+     * Linger policy: buffers and, optionally, the running stream nobody
+     * uses anymore are kept for the linger time, so a frontend coming
+     * back does not need to wait for them to be set up again.
+     */
+    std::chrono::milliseconds mLingerTime;
+    bool mLingerStream;
+    bool mLingering;
+    std::chrono::steady_clock::time_point mLingerDeadline;
+    std::condition_variable mLingerCondition;
+    std::thread mLingerThread;
+    bool mTerminate;
+
+    /*
+     * The camera buffer with the latest frame, only held for speculative
+     * start, so a frontend starting to stream on an already running camera
+     * gets a frame right away. -1 if no buffer is held.
+     */
+    int mLastFrameIndex;
+    size_t mLastFrameSize;
+    std::chrono::steady_clock::time_point mLastFrameTime;
+
     /* TODO: This needs to be a configuration option of the backend. */
     static const int BE_CONFIG_NUM_BUFFERS = 4;
 
     std::unordered_map<domid_t, Listeners> mListeners;
 
+    /*
+     * Shared buffers extension: frames are only delivered to the frontends
+     * the current camera buffers are exported for. A frontend holds one
+     * buffer at most and the camera always keeps one to fill, the camera
+     * buffer is held once per frontend.
+     * The kernel only grants dma-bufs writable and a frontend may keep the
+     * pages mapped after its access is ended, so no other frontend gets
+     * frames from the buffers once they are shared, till they are freed.
+     */
+    std::vector<DmaBuffer> mExportedBuffers;
+    std::unordered_set<domid_t> mBuffersShared;
+    FrameHolds mFrameHolds;
+
+    bool isSharedWithOthers(domid_t domId);
+
+    /*
+     * Frame rate and bandwidth quota of every frontend: frames over the
+     * quota are skipped before they are copied, only the frames which
+     * have been delivered are charged.
+     */
+    struct Quota {
+        TokenBucket frames;
+        TokenBucket bytes;
+        uint64_t throttledFrames;
+        uint64_t throttledBytes;
+    };
+
+    std::unordered_map<domid_t, Quota> mQuotas;
+
+    static const int cQuotaFrameBurst = 2;
+
+    /*
+     * Control change events are coalesced per frontend and control: the
+     * first change is sent right away, the following ones within the
+     * interval are held back and only the latest value is sent when the
+     * interval expires.
+     */
+    struct ControlEvent {
+        int64_t value;
+        int64_t sentValue;
+        bool pending;
+        std::chrono::steady_clock::time_point sentTime;
+    };
+
+    std::chrono::milliseconds mCtrlEventInterval;
+    std::unordered_map<domid_t,
+                       std::unordered_map<std::string, ControlEvent>> mCtrlEvents;
+    std::condition_variable mCtrlEventCondition;
+    std::thread mCtrlEventThread;
+
+    /*
+     * Frame delivery with the executor: the frame is copied to every
+     * frontend as a separate task, the tasks not started within the frame
+     * interval are skipped, so the frame is dropped for those frontends.
+     */
+    struct FrameTarget {
+        domid_t domId;
+        FrameListener *listener;
+        bool delivered;
+    };
+
+    std::chrono::microseconds mFrameInterval;
+    std::vector<FrameTarget> mFrameTargets;
+    uint8_t *mFrameData;
+    size_t mFrameSize;
+    Executor::Task mFrameTask;
+
+    bool frameDeliver(int index, uint8_t *data, size_t size);
+    void lastFrameKeep(int index, size_t size);
+    void lastFrameRelease();
+    void lastFrameDeliver(domid_t domId);
+    bool frameShare(domid_t domId, const SharedFrameListener& listener,
+                    int index, size_t size);
+    void frameReleaseAll(domid_t domId);
+    bool quotaCheck(domid_t domId, size_t size,
+                    std::chrono::steady_clock::time_point now);
+    void quotaCharge(domid_t domId, size_t size);
+    void quotaSet(domid_t domId);
+    void quotaReport(domid_t domId);
+
     void init(std::string uniqueId);
     void release();
 
-    void onFrameDoneCallback(int index, int size);
+    void cameraAttach();
+    void cameraRestore(std::unique_lock<std::mutex>& lock);
+    void cameraBuffersRelease();
+    void exportedRelease();
+
+    bool onFrameDoneCallback(int index, int size);
+    void onCtrlChangeCallback(int v4l2_cid, signed int value);
+
+    bool configMatches(const xencamera_req& aReq);
+
+    bool isStreamNeeded();
+    void cameraStreamStart(std::unique_lock<std::mutex>& lock);
+    void cameraStreamStop(std::unique_lock<std::mutex>& lock);
+    void waitStreamStopped(std::unique_lock<std::mutex>& lock);
+
+    void releaseUnused(std::unique_lock<std::mutex>& lock, bool linger);
+    void lingerStart();
+    void lingerThread();
+
+    void ctrlEventNotify(domid_t domId, const std::string& name,
+                         int64_t value);
+    void ctrlEventFlush();
+    void ctrlEventThread();
 
     void parseUniqueId(const std::string& uniqueId, std::string& videoId,
         std::string& mediaId);
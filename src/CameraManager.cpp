@@ -6,29 +6,173 @@
  * Copyright (C) 2018 EPAM Systems Inc.
  */
 
+#include <algorithm>
+#include <future>
+
 #include <xen/be/Exception.hpp>
 
 #include "CameraManager.hpp"
 
 using XenBackend::Exception;
 
-CameraManager::CameraManager():
-    mLog("CameraManager")
+CameraManager::CameraManager(ConfigPtr config):
+    mLog("CameraManager"),
+    mConfig(config),
+    mLingerTime(config->getBackendConfig().lingerMs),
+    mTerminate(false)
 {
+    if (mLingerTime.count() > 0)
+        mLingerThread = std::thread(&CameraManager::lingerThread, this);
+
+    int reactorThreads = config->getBackendConfig().reactorThreads;
+
+    if (reactorThreads > 0)
+        mReactor.reset(new Reactor(reactorThreads,
+                                   config->getBackendConfig().reactorThread));
+
+    int workerThreads = config->getBackendConfig().workerThreads;
+
+    if (workerThreads > 0)
+        mExecutor.reset(new Executor(workerThreads,
+                                     config->getBackendConfig().workerThread));
+
+    /* Without hot-plug the cameras are only attached on handler creation. */
+    try {
+        mDeviceWatcher.reset(new DeviceWatcher("/dev",
+            [this](const std::string& name, bool added) {
+                onDeviceChanged(name, added);
+            }));
+    } catch(const std::exception& e) {
+        LOG(mLog, WARNING) << e.what();
+        LOG(mLog, WARNING) << "Camera hot-plug is not available";
+    }
 }
 
 CameraManager::~CameraManager()
 {
+    /* Pre-warm tasks use the manager, wait for them to finish. */
+    for (auto& task : mPrewarmTasks)
+        task.wait();
+
+    mDeviceWatcher.reset();
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mTerminate = true;
+    }
+
+    mLingerCondition.notify_all();
+
+    if (mLingerThread.joinable())
+        mLingerThread.join();
+
+    mLingering.clear();
 }
 
 CameraHandlerPtr CameraManager::getNewCameraHandler(const std::string devName)
 {
-    return CameraHandlerPtr(new CameraHandler(devName));
+    return CameraHandlerPtr(new CameraHandler(devName, mConfig, mReactor,
+                                              mExecutor));
+}
+
+/*
+ * Must be called with mLock held.
+ */
+CameraHandlerPtr CameraManager::leaseCameraHandler(const std::string& uniqueId,
+                                                   CameraHandlerPtr cameraHandler)
+{
+    if (mLingerTime.count() <= 0)
+        return cameraHandler;
+
+    std::weak_ptr<CameraManager> manager = shared_from_this();
+
+    mLeasedHandlers[uniqueId] = cameraHandler;
+
+    /*
+     * The lease shares the handler, but when the last lease is released
+     * the handler goes to the linger list instead of being deleted.
+     * If the manager is already gone, the handler is just deleted.
+     */
+    return CameraHandlerPtr(cameraHandler.get(),
+        [manager, uniqueId, cameraHandler](CameraHandler *) mutable {
+            if (auto self = manager.lock())
+                self->onLeaseReleased(uniqueId, std::move(cameraHandler));
+        });
+}
+
+void CameraManager::onLeaseReleased(const std::string& uniqueId,
+                                    CameraHandlerPtr cameraHandler)
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    /*
+     * If a new handler has been created for this camera meanwhile,
+     * or we are terminating, then the handler is not needed anymore:
+     * release it out of the lock.
+     */
+    auto it = mCameraHandlers.find(uniqueId);
+
+    if (mTerminate ||
+        (it != mCameraHandlers.end() && !it->second.expired())) {
+        lock.unlock();
+        return;
+    }
+
+    LOG(mLog, DEBUG) << "Camera handler " << uniqueId << " lingers for " <<
+        mLingerTime.count() << " ms";
+
+    mLingering[uniqueId] = {
+        .cameraHandler = std::move(cameraHandler),
+        .deadline = std::chrono::steady_clock::now() + mLingerTime
+    };
+
+    mLingerCondition.notify_all();
+}
+
+void CameraManager::lingerThread()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mTerminate) {
+        auto now = std::chrono::steady_clock::now();
+        auto next = std::chrono::steady_clock::time_point::max();
+        std::vector<CameraHandlerPtr> expired;
+
+        for (auto it = mLingering.begin(); it != mLingering.end(); ) {
+            if (it->second.deadline <= now) {
+                LOG(mLog, DEBUG) << "Camera handler " << it->first <<
+                    " linger time expired";
+
+                expired.push_back(std::move(it->second.cameraHandler));
+                it = mLingering.erase(it);
+            } else {
+                next = std::min(next, it->second.deadline);
+                ++it;
+            }
+        }
+
+        if (!expired.empty()) {
+            /* Release the camera handlers out of the lock. */
+            lock.unlock();
+            expired.clear();
+            lock.lock();
+
+            /* Wake up those waiting for the handlers to be gone. */
+            mLingerCondition.notify_all();
+            continue;
+        }
+
+        if (next == std::chrono::steady_clock::time_point::max())
+            mLingerCondition.wait(lock);
+        else
+            mLingerCondition.wait_until(lock, next);
+    }
 }
 
 CameraHandlerPtr CameraManager::getCameraHandler(std::string uniqueId)
 {
-    std::lock_guard<std::mutex> lock(mLock);
+    std::unique_lock<std::mutex> lock(mLock);
 
     auto it = mCameraHandlers.find(uniqueId);
 
@@ -36,11 +180,170 @@ CameraHandlerPtr CameraManager::getCameraHandler(std::string uniqueId)
         if (auto cameraHandler = it->second.lock())
             return cameraHandler;
 
+    /*
+     * The last lease has just been released: wait for the handler to get
+     * to the linger list instead of opening the camera a second time.
+     */
+    mLingerCondition.wait(lock, [this, &uniqueId] {
+        auto leased = mLeasedHandlers.find(uniqueId);
+
+        return mTerminate || mLingering.count(uniqueId) ||
+            leased == mLeasedHandlers.end() || leased->second.expired();
+    });
+
+    /* Revive the handler if it is still lingering. */
+    auto lingering = mLingering.find(uniqueId);
+
+    if (lingering != mLingering.end()) {
+        LOG(mLog, DEBUG) << "Reuse lingering camera handler " << uniqueId;
+
+        auto cameraHandler = leaseCameraHandler(uniqueId,
+            std::move(lingering->second.cameraHandler));
+
+        mLingering.erase(lingering);
+        mCameraHandlers[uniqueId] = cameraHandler;
+
+        return cameraHandler;
+    }
+
+    auto pending = mPendingHandlers.find(uniqueId);
+
+    if (pending != mPendingHandlers.end()) {
+        auto future = pending->second;
+
+        lock.unlock();
+
+        LOG(mLog, DEBUG) << "Wait for camera handler " << uniqueId;
+
+        return future.get();
+    }
+
     /* This camera handler is not on the list yet - create now. */
-    auto cameraHandler = getNewCameraHandler(uniqueId);
+    std::promise<CameraHandlerPtr> promise;
+
+    mPendingHandlers[uniqueId] = promise.get_future().share();
+
+    lock.unlock();
+
+    CameraHandlerPtr cameraHandler;
 
+    try {
+        cameraHandler = getNewCameraHandler(uniqueId);
+    } catch (...) {
+        lock.lock();
+        mPendingHandlers.erase(uniqueId);
+        lock.unlock();
+
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    lock.lock();
+    cameraHandler = leaseCameraHandler(uniqueId, cameraHandler);
     mCameraHandlers[uniqueId] = cameraHandler;
+    mPendingHandlers.erase(uniqueId);
+    lock.unlock();
+
+    promise.set_value(cameraHandler);
 
     return cameraHandler;
 }
 
+/*
+ * Camera handlers which are in use or lingering. The returned references
+ * keep the handlers alive, so these can be used out of the lock.
+ */
+std::vector<CameraHandlerPtr> CameraManager::getActiveCameraHandlers()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    std::vector<CameraHandlerPtr> cameraHandlers;
+
+    if (mTerminate)
+        return cameraHandlers;
+
+    for (auto const& entry : mCameraHandlers)
+        if (auto cameraHandler = entry.second.lock())
+            cameraHandlers.push_back(cameraHandler);
+
+    for (auto const& entry : mLingering)
+        cameraHandlers.push_back(entry.second.cameraHandler);
+
+    return cameraHandlers;
+}
+
+void CameraManager::onDeviceChanged(const std::string& name, bool added)
+{
+    /* Attaching the camera takes time, so do it out of the lock. */
+    for (auto const& cameraHandler : getActiveCameraHandlers()) {
+        if (cameraHandler->getVideoId() != name)
+            continue;
+
+        if (added)
+            cameraHandler->deviceAttach();
+        else
+            cameraHandler->deviceDetach();
+    }
+}
+
+void CameraManager::reloadConfig(ConfigPtr config)
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mConfig = config;
+    }
+
+    for (auto const& cameraHandler : getActiveCameraHandlers())
+        cameraHandler->reloadConfig(config);
+}
+
+ConfigPtr CameraManager::getConfig()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return mConfig;
+}
+
+void CameraManager::prewarm()
+{
+    auto uniqueIds = mConfig->getBackendConfig().prewarm;
+
+    std::sort(uniqueIds.begin(), uniqueIds.end());
+    uniqueIds.erase(std::unique(uniqueIds.begin(), uniqueIds.end()),
+                    uniqueIds.end());
+
+    /*
+     * Open and configure all the cameras in parallel and in the
+     * background: most of the time is spent in the drivers, e.g.
+     * enumerating the device or setting up the media pipeline, so
+     * neither unrelated cameras nor the backend start need to wait.
+     * A frontend binding meanwhile waits for its own camera only.
+     */
+    std::lock_guard<std::mutex> lock(mLock);
+
+    for (auto const& uniqueId : uniqueIds) {
+        LOG(mLog, DEBUG) << "Pre-warm camera handler " << uniqueId;
+
+        mPrewarmTasks.push_back(std::async(std::launch::async,
+                                           &CameraManager::prewarmCamera,
+                                           this, uniqueId));
+    }
+}
+
+void CameraManager::prewarmCamera(const std::string uniqueId)
+{
+    CameraHandlerPtr cameraHandler;
+
+    /* A camera which fails to open must not keep the others from working. */
+    try {
+        cameraHandler = getCameraHandler(uniqueId);
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << "Failed to pre-warm camera handler " <<
+            uniqueId << ": " << e.what();
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mPrewarmed.push_back(cameraHandler);
+}
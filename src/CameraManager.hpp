@@ -8,27 +8,107 @@
 #ifndef SRC_CAMERAMANAGER_HPP_
 #define SRC_CAMERAMANAGER_HPP_
 
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <xen/be/Log.hpp>
 
 #include "CameraHandler.hpp"
+#include "Config.hpp"
+#include "DeviceWatcher.hpp"
 
-class CameraManager
+class CameraManager : public std::enable_shared_from_this<CameraManager>
 {
 public:
-    CameraManager();
+    CameraManager(ConfigPtr config);
     ~CameraManager();
 
     CameraHandlerPtr getCameraHandler(std::string uniqueId);
 
+    void prewarm();
+
+    void reloadConfig(ConfigPtr config);
+
+    ConfigPtr getConfig();
+
 private:
     XenBackend::Log mLog;
     std::mutex mLock;
 
+    ConfigPtr mConfig;
+
+    /* Shared by all the cameras if configured. */
+    ReactorPtr mReactor;
+    ExecutorPtr mExecutor;
+
     std::unordered_map<std::string, CameraHandlerWeakPtr> mCameraHandlers;
 
+    /*
+     * Camera handlers being constructed now: the lock is not held while
+     * a handler is initialized, so other cameras can be brought up in
+     * parallel, and concurrent requests for the same camera wait for
+     * the single initialization in progress.
+     */
+    std::unordered_map<std::string,
+                       std::shared_future<CameraHandlerPtr>> mPendingHandlers;
+
+    /*
+     * Pre-warmed camera handlers are kept here for the whole lifetime
+     * of the backend, so they are not released when the last frontend
+     * using them goes away.
+     */
+    std::vector<CameraHandlerPtr> mPrewarmed;
+    std::vector<std::future<void>> mPrewarmTasks;
+
+    void prewarmCamera(const std::string uniqueId);
+
+    /*
+     * Linger policy: frontends get a lease on the camera handler and
+     * when the last lease is gone the handler is kept here for the
+     * linger time, so a frontend reconnecting in the meantime does not
+     * need to initialize the camera again.
+     */
+    struct LingerEntry {
+        CameraHandlerPtr cameraHandler;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    std::chrono::milliseconds mLingerTime;
+    std::unordered_map<std::string, LingerEntry> mLingering;
+
+    /*
+     * Handlers behind the leases: the lease expires before its deleter
+     * hands the handler over to the linger list, so a handler still alive
+     * here while its lease has expired is on the way there.
+     */
+    std::unordered_map<std::string, CameraHandlerWeakPtr> mLeasedHandlers;
+
+    std::condition_variable mLingerCondition;
+    std::thread mLingerThread;
+    bool mTerminate;
+
+    /*
+     * Camera device nodes appearing and disappearing are routed to the
+     * camera handlers using them, so the camera is re-attached without
+     * restarting the backend.
+     */
+    DeviceWatcherPtr mDeviceWatcher;
+
     CameraHandlerPtr getNewCameraHandler(const std::string devName);
+
+    CameraHandlerPtr leaseCameraHandler(const std::string& uniqueId,
+                                        CameraHandlerPtr cameraHandler);
+    void onLeaseReleased(const std::string& uniqueId,
+                         CameraHandlerPtr cameraHandler);
+    void lingerThread();
+
+    std::vector<CameraHandlerPtr> getActiveCameraHandlers();
+
+    void onDeviceChanged(const std::string& name, bool added);
 };
 
 typedef std::shared_ptr<CameraManager> CameraManagerPtr;
@@ -7,6 +7,8 @@
  * Copyright (C) 2018 EPAM Systems Inc.
  */
 
+#include <sys/mman.h>
+
 #include <algorithm>
 #include <iomanip>
 
@@ -30,30 +32,94 @@ std::unordered_map<int, CommandHandler::CommandFn> CommandHandler::sCmdTable =
     { XENCAMERA_OP_BUF_QUEUE,           &CommandHandler::bufQueue },
     { XENCAMERA_OP_BUF_DEQUEUE,         &CommandHandler::bufDequeue },
     { XENCAMERA_OP_CTRL_ENUM,           &CommandHandler::ctrlEnum },
-    { XENCAMERA_OP_CTRL_SET,            &CommandHandler::ctrlSet },
     { XENCAMERA_OP_CTRL_GET,            &CommandHandler::ctrlGet },
     { XENCAMERA_OP_STREAM_START,        &CommandHandler::streamStart },
     { XENCAMERA_OP_STREAM_STOP,         &CommandHandler::streamStop },
 };
 
-CtrlRingBuffer::CtrlRingBuffer(EventRingBufferPtr eventBuffer,
+CtrlRingBuffer::CtrlRingBuffer(GrantMapperPtr mapper,
+                               EventRingBufferPtr eventBuffer,
                                domid_t domId, evtchn_port_t port,
                                grant_ref_t ref,
                                std::string ctrls,
-                               CameraHandlerPtr cameraHandler) :
+                               CameraHandlerPtr cameraHandler,
+                               const Config::BackendConfig& config,
+                               SharedBuffersPublisher publisher) :
     RingBufferInBase<xen_cameraif_back_ring, xen_cameraif_sring,
                      xencamera_req, xencamera_resp>(domId, port, ref),
-    mCommandHandler(domId, eventBuffer, ctrls, cameraHandler),
-    mLog("CamCtrlRing")
+    mCommandHandler(domId, mapper, eventBuffer, ctrls, cameraHandler, config,
+                    publisher),
+    mLog("CamCtrlRing"),
+    mTerminate(false),
+    mPendingBufOps(0)
 {
     LOG(mLog, DEBUG) << "Create ctrl ring buffer";
+
+    mThread = std::thread(&CtrlRingBuffer::workerThread, this);
 }
 
-void CtrlRingBuffer::processRequest(const xencamera_req& req)
+CtrlRingBuffer::~CtrlRingBuffer()
 {
-    DLOG(mLog, DEBUG) << "Request received, cmd:"
-        << static_cast<int>(req.operation);
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mTerminate = true;
+    }
+
+    mCondition.notify_all();
+
+    if (mThread.joinable())
+        mThread.join();
+
+    LOG(mLog, DEBUG) << "Delete ctrl ring buffer";
+}
+
+static bool isBufOp(int operation)
+{
+    return operation == XENCAMERA_OP_BUF_REQUEST ||
+        operation == XENCAMERA_OP_BUF_CREATE ||
+        operation == XENCAMERA_OP_BUF_DESTROY;
+}
+
+/*
+ * Must be called with mLock held.
+ */
+bool CtrlRingBuffer::isAsync(const xencamera_req& req)
+{
+    switch (req.operation) {
+    /* These may take long: always handled by the worker. */
+    case XENCAMERA_OP_CONFIG_SET:
+    case XENCAMERA_OP_CONFIG_VALIDATE:
+    case XENCAMERA_OP_FRAME_RATE_SET:
+    case XENCAMERA_OP_BUF_REQUEST:
+    case XENCAMERA_OP_BUF_CREATE:
+    case XENCAMERA_OP_BUF_DESTROY:
+    /* Always queued, so consecutive ones can be batched. */
+    case XENCAMERA_OP_CTRL_SET:
+    case XENCAMERA_OP_STREAM_START:
+    case XENCAMERA_OP_STREAM_STOP:
+        return true;
+
+    /* Only depend on the buffers being created or destroyed. */
+    case XENCAMERA_OP_BUF_QUEUE:
+    case XENCAMERA_OP_BUF_DEQUEUE:
+        return mPendingBufOps;
+
+    /* Static description of the controls. */
+    case XENCAMERA_OP_CTRL_ENUM:
+        return false;
+
+    /*
+     * Getters must see the result of all the requests sent before,
+     * as well as unknown requests must be responded in order.
+     */
+    default:
+        return !mPending.empty();
+    }
+}
 
+void CtrlRingBuffer::handleRequest(const xencamera_req& req)
+{
     xencamera_resp rsp {0};
 
     rsp.id = req.id;
@@ -61,30 +127,203 @@ void CtrlRingBuffer::processRequest(const xencamera_req& req)
 
     rsp.status = mCommandHandler.processCommand(req, rsp);
 
+    std::lock_guard<std::mutex> lock(mResponseLock);
+
     sendResponse(rsp);
 }
 
-EventRingBuffer::EventRingBuffer(domid_t domId, evtchn_port_t port,
-                                 grant_ref_t ref, int offset, size_t size) :
-    RingBufferOutBase<xencamera_event_page, xencamera_evt>(domId, port, ref,
-                                                           offset, size),
-    mLog("CamEventRing")
+void CtrlRingBuffer::handleCtrlSet(const std::vector<xencamera_req>& reqs)
+{
+    std::vector<xencamera_resp> resps;
+
+    mCommandHandler.processCtrlSet(reqs, resps);
+
+    std::lock_guard<std::mutex> lock(mResponseLock);
+
+    for (auto const& rsp : resps)
+        sendResponse(rsp);
+}
+
+void CtrlRingBuffer::processRequest(const xencamera_req& req)
+{
+    DLOG(mLog, DEBUG) << "Request received, cmd:"
+        << static_cast<int>(req.operation);
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if (isAsync(req)) {
+            mPending.push_back(req);
+
+            if (isBufOp(req.operation))
+                mPendingBufOps++;
+
+            mCondition.notify_one();
+
+            return;
+        }
+    }
+
+    handleRequest(req);
+}
+
+void CtrlRingBuffer::workerThread()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mTerminate) {
+        if (mPending.empty()) {
+            mCondition.wait(lock);
+            continue;
+        }
+
+        /*
+         * Controls set one after another, e.g. a preset, are applied
+         * together as a single batch: all the CTRL_SET requests pending
+         * in a row, so a CTRL_SET coming while the batch is being applied
+         * goes to the next one.
+         */
+        if (mPending.front().operation == XENCAMERA_OP_CTRL_SET) {
+            auto end = std::find_if(mPending.begin(), mPending.end(),
+                [](const xencamera_req& req) {
+                    return req.operation != XENCAMERA_OP_CTRL_SET;
+                });
+            std::vector<xencamera_req> reqs(mPending.begin(), end);
+
+            lock.unlock();
+
+            try {
+                handleCtrlSet(reqs);
+            } catch(const std::exception& e) {
+                LOG(mLog, ERROR) << e.what();
+            }
+
+            lock.lock();
+
+            mPending.erase(mPending.begin(), mPending.begin() + reqs.size());
+
+            continue;
+        }
+
+        /* Keep it in the queue until done, so the later requests wait. */
+        auto req = mPending.front();
+
+        lock.unlock();
+
+        try {
+            handleRequest(req);
+        } catch(const std::exception& e) {
+            LOG(mLog, ERROR) << e.what();
+        }
+
+        lock.lock();
+
+        mPending.pop_front();
+
+        if (isBufOp(req.operation))
+            mPendingBufOps--;
+    }
+
+    if (!mPending.empty())
+        LOG(mLog, WARNING) << "Drop " << mPending.size() <<
+            " pending requests";
+}
+
+EventRingBuffer::EventRingBuffer(GrantMapperPtr mapper, domid_t domId,
+                                 evtchn_port_t port, grant_ref_t ref,
+                                 int offset, size_t size) :
+    EventRingBuffer(mapper, ref, offset, size)
+{
+    mEventChannel.reset(new XenBackend::XenEvtchn(domId, port, [] {}));
+}
+
+EventRingBuffer::EventRingBuffer(GrantMapperPtr mapper, grant_ref_t ref,
+                                 int offset, size_t size) :
+    mLog("CamEventRing"),
+    mBuffer(mapper, &ref, 1, PROT_READ | PROT_WRITE),
+    mPage(static_cast<xencamera_event_page *>(mBuffer.get())),
+    mEvents(reinterpret_cast<xencamera_evt *>(
+        static_cast<uint8_t *>(mBuffer.get()) + offset)),
+    mNumEvents(size / sizeof(xencamera_evt)),
+    mNotifiedProd(mPage->in_prod)
 {
     LOG(mLog, DEBUG) << "Create event ring buffer";
 }
 
-CommandHandler::CommandHandler(domid_t domId,
+bool EventRingBuffer::isFullLocked()
+{
+    uint32_t cons = mPage->in_cons;
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return mPage->in_prod - cons >= mNumEvents;
+}
+
+bool EventRingBuffer::isFull()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return isFullLocked();
+}
+
+bool EventRingBuffer::queueEvent(const xencamera_evt& event)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (isFullLocked())
+        return false;
+
+    uint32_t prod = mPage->in_prod;
+
+    mEvents[prod % mNumEvents] = event;
+
+    /* The event must be visible before the producer index. */
+    std::atomic_thread_fence(std::memory_order_release);
+
+    mPage->in_prod = prod + 1;
+
+    return true;
+}
+
+void EventRingBuffer::flush()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mPage->in_prod == mNotifiedProd)
+        return;
+
+    mNotifiedProd = mPage->in_prod;
+
+    if (mEventChannel)
+        mEventChannel->notify();
+}
+
+CommandHandler::CommandHandler(domid_t domId, GrantMapperPtr mapper,
                                EventRingBufferPtr eventBuffer,
                                std::string ctrls,
-                               CameraHandlerPtr cameraHandler) :
+                               CameraHandlerPtr cameraHandler,
+                               const Config::BackendConfig& config,
+                               SharedBuffersPublisher publisher) :
     mDomId(domId),
     mEventBuffer(eventBuffer),
 	mEventId(0),
     mCameraHandler(cameraHandler),
-    mLog("CommandHandler")
+    mLog("CommandHandler"),
+    mGrantCopy(config.grantCopy),
+    mGrantMapper(mapper),
+    mPublisher(publisher),
+    mFramesDropped(0),
+    mEventsDropped(0)
 {
     LOG(mLog, DEBUG) << "Create command handler";
 
+    size_t grantCacheSize = static_cast<size_t>(config.grantCacheMb) *
+        1024 * 1024;
+
+    if (grantCacheSize && !mGrantCopy)
+        mMappingCache.reset(new BufferMappingCache(mGrantMapper, domId,
+                                                   grantCacheSize));
+
     try {
         init(ctrls);
     } catch (...) {
@@ -116,6 +355,10 @@ void CommandHandler::init(std::string ctrls)
                           this, _1, _2),
             .control = bind(&CommandHandler::onCtrlChangeCallback,
                             this, _1, _2),
+            .flush = std::bind(&CommandHandler::onFlushCallback, this),
+            .shared = mPublisher ?
+                bind(&CommandHandler::onSharedFrameCallback, this, _1, _2) :
+                CameraHandler::SharedFrameListener(),
         });
 }
 
@@ -124,14 +367,17 @@ void CommandHandler::release()
     mCameraHandler->listenerReset(mDomId);
 }
 
-int CommandHandler::processCommand(const xencamera_req& req,
-                                   xencamera_resp& resp)
+/*
+ * Run the command and turn its errors into the response status.
+ */
+template<typename F>
+int CommandHandler::handleErrors(F fn)
 {
     int status = 0;
 
     try
     {
-        (this->*sCmdTable.at(req.operation))(req, resp);
+        fn();
     }
     catch(const XenBackend::Exception& e)
     {
@@ -166,6 +412,57 @@ int CommandHandler::processCommand(const xencamera_req& req,
     return status;
 }
 
+int CommandHandler::processCommand(const xencamera_req& req,
+                                   xencamera_resp& resp)
+{
+    return handleErrors([this, &req, &resp] {
+        (this->*sCmdTable.at(req.operation))(req, resp);
+    });
+}
+
+void CommandHandler::processCtrlSet(const std::vector<xencamera_req>& reqs,
+                                    std::vector<xencamera_resp>& resps)
+{
+    std::vector<Camera::ControlValue> values;
+    std::vector<size_t> batched;
+
+    resps.assign(reqs.size(), xencamera_resp {0});
+
+    for (size_t i = 0; i < reqs.size(); i++) {
+        resps[i].id = reqs[i].id;
+        resps[i].operation = reqs[i].operation;
+
+        resps[i].status = handleErrors([this, &reqs, &values, i] {
+            auto value = ctrlSetValidate(reqs[i]);
+
+            /* The control set later in the batch wins. */
+            for (auto& ctrl : values)
+                if (ctrl.v4l2_cid == value.v4l2_cid) {
+                    ctrl.value = value.value;
+                    return;
+                }
+
+            values.push_back(value);
+        });
+
+        if (!resps[i].status)
+            batched.push_back(i);
+    }
+
+    if (values.empty())
+        return;
+
+    DLOG(mLog, DEBUG) << "Handle command [SET CTRL] dom " <<
+        std::to_string(mDomId) << ", batch of " << values.size();
+
+    int status = handleErrors([this, &values] {
+        mCameraHandler->ctrlSetValues(mDomId, values);
+    });
+
+    for (auto i : batched)
+        resps[i].status = status;
+}
+
 void CommandHandler::configSet(const xencamera_req& req,
                                xencamera_resp& resp)
 {
@@ -200,6 +497,10 @@ void CommandHandler::bufRequest(const xencamera_req& req,
                                 xencamera_resp& resp)
 {
     mCameraHandler->bufRequest(mDomId, req, resp);
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mQueuedBuffers.reserve(resp.resp.buf_request.num_bufs);
 }
 
 void CommandHandler::bufCreate(const xencamera_req& req,
@@ -212,11 +513,25 @@ void CommandHandler::bufCreate(const xencamera_req& req,
         std::to_string(create->index) << " offset " <<
         std::to_string(create->plane_offset[0]);
 
+    if (mPublisher)
+        throw XenBackend::Exception("Frontend shares the camera buffers, "
+                                    "no buffers to create", EINVAL);
+
     size_t imageSize = mCameraHandler->bufGetImageSize(mDomId);
 
-    mBuffers[create->index] = FrontendBufferPtr(new FrontendBuffer(mDomId,
-                                                                   imageSize,
-                                                                   req));
+    /* Map the buffer without the lock: frames keep coming meanwhile. */
+    FrontendBufferPtr buffer;
+
+    if (mGrantCopy)
+        buffer.reset(new CopyFrontendBuffer(mGrantMapper, mDomId, imageSize,
+                                            req));
+    else
+        buffer.reset(new MappedFrontendBuffer(mGrantMapper, mDomId, imageSize,
+                                              req, mMappingCache));
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mBuffers[create->index] = std::move(buffer);
 }
 
 void CommandHandler::bufDestroy(const xencamera_req& req,
@@ -227,25 +542,52 @@ void CommandHandler::bufDestroy(const xencamera_req& req,
     DLOG(mLog, DEBUG) << "Handle command [BUF DESTROY] dom " <<
         std::to_string(mDomId) << " index " << std::to_string(index);
 
-    mBuffers.erase(index);
+    FrontendBufferPtr buffer;
+    bool empty;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mBuffers.find(index);
+
+        if (it != mBuffers.end()) {
+            /* Unmap the buffer out of the lock. */
+            buffer = std::move(it->second);
+            mBuffers.erase(it);
+        }
+
+        empty = mBuffers.empty();
+    }
+
+    buffer.reset();
+
     /*
      * If this was the last buffer then tell the CameraHandler it might
      * release the buffers.
      */
-    if (!mBuffers.size())
+    if (empty)
             mCameraHandler->bufRelease(mDomId);
 }
 
 void CommandHandler::bufQueue(const xencamera_req& req,
                               xencamera_resp& resp)
 {
-    std::lock_guard<std::mutex> lock(mLock);
     size_t index = static_cast<size_t>(req.req.index.index);
 
     DLOG(mLog, DEBUG) << "Handle command [BUF QUEUE] dom " <<
-        std::to_string(mDomId) << " index " << std::to_string(index);
+        mDomId << " index " << index;
+
+    /* The frontend is done with the camera buffer it has been reading. */
+    if (mPublisher) {
+        mCameraHandler->frameRelease(mDomId, index);
+    } else {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        if (std::find(mQueuedBuffers.begin(), mQueuedBuffers.end(),
+                      index) == mQueuedBuffers.end())
+            mQueuedBuffers.push_back(index);
+    }
 
-    mQueuedBuffers.push_back(index);
+    mCameraHandler->bufQueued(mDomId);
 }
 
 void CommandHandler::bufDequeue(const xencamera_req& req,
@@ -255,23 +597,97 @@ void CommandHandler::bufDequeue(const xencamera_req& req,
     size_t index = static_cast<size_t>(req.req.index.index);
 
     DLOG(mLog, DEBUG) << "Handle command [BUF DEQUEUE] dom " <<
-        std::to_string(mDomId) << " index " << std::to_string(index);
+        mDomId << " index " << index;
 
-    mQueuedBuffers.remove(index);
+    mQueuedBuffers.erase(std::remove(mQueuedBuffers.begin(),
+                                     mQueuedBuffers.end(), index),
+                         mQueuedBuffers.end());
 }
 
-void CommandHandler::onFrameDoneCallback(uint8_t *data, size_t size)
+bool CommandHandler::onFrameDoneCallback(uint8_t *data, size_t size)
 {
     std::lock_guard<std::mutex> lock(mLock);
     int index;
 
     if (mQueuedBuffers.empty())
-        return;
+        return false;
 
     index = mQueuedBuffers.front();
 
+    auto buffer = mBuffers.find(index);
+
+    if (buffer == mBuffers.end())
+        return false;
+
+    if (frameDropIfFull())
+        return true;
+
+    /*
+     * The frontend must not get the buffer if the frame is not in it:
+     * the frame is lost, the buffer stays queued for the next one.
+     */
+    try {
+        buffer->second->copyBuffer(data, size);
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << "Can't copy frame to buffer " << index <<
+            ", dom " << std::to_string(mDomId) << ": " << e.what();
+
+        mSequence++;
+
+        return false;
+    }
+
+    return frameEventSend(index, size);
+}
+
+/*
+ * The frontend reads the frame in place from the camera buffer.
+ */
+bool CommandHandler::onSharedFrameCallback(int index, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    /* Not consumed, so the camera buffer is not held. */
+    if (frameDropIfFull())
+        return false;
+
+    return frameEventSend(index, size);
+}
+
+/*
+ * The frontend does not keep up with the events: drop the frame
+ * without copying it rather than wait for the ring.
+ * Must be called with mLock held.
+ */
+bool CommandHandler::frameDropIfFull()
+{
+    if (mEventBuffer->isFull()) {
+        if (!mFramesDropped++)
+            LOG(mLog, WARNING) << "Event ring is full, dropping frames, dom " <<
+                std::to_string(mDomId);
+
+        mSequence++;
+
+        return true;
+    }
+
+    if (mFramesDropped) {
+        LOG(mLog, WARNING) << "Dropped " << mFramesDropped <<
+            " frames, dom " << std::to_string(mDomId);
+
+        mFramesDropped = 0;
+    }
+
+    return false;
+}
+
+/*
+ * Must be called with mLock held.
+ */
+bool CommandHandler::frameEventSend(int index, size_t size)
+{
     DLOG(mLog, DEBUG) << "Send event [FRAME] dom " <<
-        std::to_string(mDomId) << " index " << std::to_string(index);
+        mDomId << " index " << index;
 
     xencamera_evt event {0};
 
@@ -279,11 +695,24 @@ void CommandHandler::onFrameDoneCallback(uint8_t *data, size_t size)
     event.evt.frame_avail.index = index;
     event.evt.frame_avail.used_sz = size;
     event.evt.frame_avail.seq_num = mSequence++;
-    event.id = mEventId++;
+    event.id = mEventId;
+
+    /*
+     * A control event may have taken the last slot since frameDropIfFull:
+     * the frame is lost then, as if the ring was full.
+     */
+    if (!mEventBuffer->queueEvent(event)) {
+        if (!mFramesDropped++)
+            LOG(mLog, WARNING) << "Event ring is full, dropping frames, dom " <<
+                std::to_string(mDomId);
+
+        return false;
+    }
 
-    mBuffers[index]->copyBuffer(data, size);
+    mEventId++;
+    mEventBuffer->flush();
 
-    mEventBuffer->sendEvent(event);
+    return true;
 }
 
 void CommandHandler::ctrlEnum(const xencamera_req& req,
@@ -309,14 +738,10 @@ void CommandHandler::ctrlEnum(const xencamera_req& req,
     mCameraHandler->ctrlEnum(mDomId, req, resp, mControls[index]);
 }
 
-void CommandHandler::ctrlSet(const xencamera_req& req,
-                             xencamera_resp& resp)
+Camera::ControlValue CommandHandler::ctrlSetValidate(const xencamera_req& req)
 {
     int type = req.req.ctrl_value.type;
 
-    DLOG(mLog, DEBUG) << "Handle command [SET CTRL] dom " <<
-        std::to_string(mDomId);
-
     if (mControls.empty())
         throw XenBackend::Exception("No assigned controls", EINVAL);
 
@@ -327,7 +752,10 @@ void CommandHandler::ctrlSet(const xencamera_req& req,
         throw XenBackend::Exception("Wrong control type " +
                                     std::to_string(type), EINVAL);
 
-    mCameraHandler->ctrlSet(mDomId, req, resp, ctrlName);
+    return {
+        .v4l2_cid = V4L2ToXen::ctrlToV4L2(type),
+        .value = static_cast<signed int>(req.req.ctrl_value.value)
+    };
 }
 
 void CommandHandler::ctrlGet(const xencamera_req& req,
@@ -347,12 +775,33 @@ void CommandHandler::ctrlGet(const xencamera_req& req,
         mControls.end())
         throw XenBackend::Exception("Wrong control type " +
                                     std::to_string(type), EINVAL);
+
+    mCameraHandler->ctrlGet(mDomId, req, resp, ctrlName);
 }
 
 void CommandHandler::streamStart(const xencamera_req& req,
                                  xencamera_resp& resp)
 {
-    mSequence = 0;
+    {
+        /* Frames of another camera user may still be coming in. */
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mSequence = 0;
+    }
+
+    /* Buffers which have not been created again by now are gone. */
+    if (mMappingCache)
+        mMappingCache->clear();
+
+    /* Grant the camera buffers before the first frame comes. */
+    if (mPublisher) {
+        SharedBuffersPtr sharedBuffers(new SharedBuffers(mDomId,
+            mCameraHandler->bufExport(mDomId)));
+
+        mPublisher(sharedBuffers->getDirectories());
+        mSharedBuffers = std::move(sharedBuffers);
+    }
+
     mCameraHandler->streamStart(mDomId, req, resp);
 }
 
@@ -360,9 +809,16 @@ void CommandHandler::streamStop(const xencamera_req& req,
                                 xencamera_resp& resp)
 {
     mCameraHandler->streamStop(mDomId, req, resp);
+
+    /* Nothing is held anymore, so the access can be ended. */
+    if (mSharedBuffers) {
+        mPublisher({});
+        mSharedBuffers.reset();
+    }
 }
 
-void CommandHandler::onCtrlChangeCallback(const std::string name, int64_t value)
+void CommandHandler::onCtrlChangeCallback(const std::string& name,
+                                          int64_t value)
 {
     if (mControls.empty()) {
         DLOG(mLog, DEBUG) << "No assigned controls, skipping";
@@ -384,8 +840,23 @@ void CommandHandler::onCtrlChangeCallback(const std::string name, int64_t value)
     event.type = XENCAMERA_EVT_CTRL_CHANGE;
     event.evt.ctrl_value.type = V4L2ToXen::ctrlGetTypeXen(name);
     event.evt.ctrl_value.value = value;
-    event.id = mEventId++;
 
-    mEventBuffer->sendEvent(event);
+    std::lock_guard<std::mutex> lock(mLock);
+
+    event.id = mEventId;
+
+    /* The frontend is notified on flush, once for all the changes. */
+    if (!mEventBuffer->queueEvent(event)) {
+        LOG(mLog, WARNING) << "Event ring is full, dropped [CTRL] event, dom " <<
+            std::to_string(mDomId) << ", total " << ++mEventsDropped;
+        return;
+    }
+
+    mEventId++;
+}
+
+void CommandHandler::onFlushCallback()
+{
+    mEventBuffer->flush();
 }
 
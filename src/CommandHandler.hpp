@@ -8,40 +8,98 @@
 #ifndef SRC_COMMANDHANDLER_HPP_
 #define SRC_COMMANDHANDLER_HPP_
 
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <xen/be/RingBufferBase.hpp>
 #include <xen/be/Log.hpp>
+#include <xen/be/XenEvtchn.hpp>
+#include <xen/be/XenGnttab.hpp>
 
 #include <xen/io/cameraif.h>
 
 #include "CameraHandler.hpp"
 
-class EventRingBuffer : public XenBackend::RingBufferOutBase<
-                        xencamera_event_page, xencamera_evt>
+/***************************************************************************//**
+ * Ring buffer used for the camera events.
+ * Events are put to the ring without notifying the frontend, which is only
+ * notified on flush if there are new events since the previous one, so
+ * a burst of events costs a single notification. The ring never blocks:
+ * if it is full, then the event is not put and the caller decides what to
+ * do with it.
+ * The ring page is mapped with the grant mapper of the frontend.
+ ******************************************************************************/
+class EventRingBuffer
 {
 public:
-    EventRingBuffer(domid_t domId, evtchn_port_t port,
+    EventRingBuffer(GrantMapperPtr mapper, domid_t domId, evtchn_port_t port,
                     grant_ref_t ref, int offset, size_t size);
+    /* No event channel: for a stand-in frontend, which polls the ring. */
+    EventRingBuffer(GrantMapperPtr mapper, grant_ref_t ref, int offset,
+                    size_t size);
+
+    bool isFull();
+    bool queueEvent(const xencamera_evt& event);
+    void flush();
 
 private:
     XenBackend::Log mLog;
+    std::mutex mLock;
+
+    GrantMapping mBuffer;
+    std::unique_ptr<XenBackend::XenEvtchn> mEventChannel;
+
+    xencamera_event_page *mPage;
+    xencamera_evt *mEvents;
+    uint32_t mNumEvents;
+    uint32_t mNotifiedProd;
+
+    bool isFullLocked();
 };
 
 typedef std::shared_ptr<EventRingBuffer> EventRingBufferPtr;
 
+/*
+ * Publishes the page directories of the camera buffers granted to the
+ * frontend with the shared buffers extension, see SharedBuffers. Empty
+ * list withdraws them.
+ */
+typedef std::function<void(const std::vector<grant_ref_t>&)>
+    SharedBuffersPublisher;
+
 class CommandHandler
 {
 public:
-    CommandHandler(domid_t domId, EventRingBufferPtr eventBuffer,
-                   std::string ctrls, CameraHandlerPtr cameraHandler);
+    /*
+     * Publisher is only set if the frontend uses the shared buffers.
+     * All the grant operations on the frontend buffers go through mapper.
+     */
+    CommandHandler(domid_t domId, GrantMapperPtr mapper,
+                   EventRingBufferPtr eventBuffer,
+                   std::string ctrls, CameraHandlerPtr cameraHandler,
+                   const Config::BackendConfig& config,
+                   SharedBuffersPublisher publisher = nullptr);
     ~CommandHandler();
 
     int processCommand(const xencamera_req& req, xencamera_resp& resp);
+    /*
+     * Handle consecutive CTRL_SET requests at once: the valid ones are
+     * applied as a single batch, on the same frame. Responses are filled
+     * for all the requests, in order. This is the only way CTRL_SET is
+     * handled, processCommand does not take it.
+     */
+    void processCtrlSet(const std::vector<xencamera_req>& reqs,
+                        std::vector<xencamera_resp>& resps);
 
 private:
+    /* Counts the allocations of the frame path. */
+    friend class FrameAllocTest;
+
     typedef void(CommandHandler::*CommandFn)(const xencamera_req& aReq,
                                              xencamera_resp& aResp);
 
@@ -59,8 +117,17 @@ private:
     std::mutex mLock;
 
     std::vector<std::string> mControls;
+    /* Frames are written with grant copy instead of mapping the buffers. */
+    bool mGrantCopy;
+    /* Grant operations of all the buffers of the frontend. */
+    GrantMapperPtr mGrantMapper;
+    BufferMappingCachePtr mMappingCache;
     std::unordered_map<int, FrontendBufferPtr> mBuffers;
 
+    /* Shared buffers extension: granted while streaming. */
+    SharedBuffersPublisher mPublisher;
+    SharedBuffersPtr mSharedBuffers;
+
     /*
      * Buffer management
      * 1. Frontend sends queue event: add the buffer to the queued list end
@@ -69,8 +136,10 @@ private:
      * from the queued list
      * 2.2. If there are no buffers in the queued list, then do nothing
      * 3. Frontend sends dequeue event: remove the buffer from the queued list
+     * Room for all the buffers is reserved on buffer request, so queueing
+     * does not allocate while streaming.
      */
-    std::list<int> mQueuedBuffers;
+    std::vector<int> mQueuedBuffers;
 
     uint32_t mSequence;
 
@@ -91,33 +160,76 @@ private:
     void bufDequeue(const xencamera_req& aReq, xencamera_resp& aResp);
 
     void ctrlEnum(const xencamera_req& aReq, xencamera_resp& aResp);
-    void ctrlSet(const xencamera_req& aReq, xencamera_resp& aResp);
+    Camera::ControlValue ctrlSetValidate(const xencamera_req& aReq);
     void ctrlGet(const xencamera_req& aReq, xencamera_resp& aResp);
 
     void streamStart(const xencamera_req& aReq, xencamera_resp& aResp);
     void streamStop(const xencamera_req& aReq, xencamera_resp& aResp);
 
-    void onFrameDoneCallback(uint8_t *data, size_t size);
-    void onCtrlChangeCallback(const std::string name, int64_t value);
+    /*
+     * Frame events which could not be sent because the event ring was full:
+     * the frame is dropped, but the sequence number is incremented, so the
+     * frontend sees the gap.
+     */
+    uint64_t mFramesDropped;
+    uint64_t mEventsDropped;
+
+    template<typename F>
+    int handleErrors(F fn);
+
+    bool onFrameDoneCallback(uint8_t *data, size_t size);
+    bool onSharedFrameCallback(int index, size_t size);
+    bool frameDropIfFull();
+    bool frameEventSend(int index, size_t size);
+    void onCtrlChangeCallback(const std::string& name, int64_t value);
+    void onFlushCallback();
 };
 
 /***************************************************************************//**
  * Ring buffer used for the camera control.
+ * Slow requests, e.g. those which change the format or map the buffers, are
+ * handled by the worker thread in the order they come and are responded
+ * when done, so the responses may go out of order. Fast requests are handled
+ * right away, unless a pending slow request they depend on is not yet done:
+ * then they are queued behind it.
+ * N CTRL_SET requests pending in a row, e.g. pipelined by the frontend for
+ * a preset, are applied as one batch and get their N responses in order;
+ * a failed request does not keep the others of the batch from being set.
  ******************************************************************************/
 class CtrlRingBuffer : public XenBackend::RingBufferInBase<xen_cameraif_back_ring,
     xen_cameraif_sring, xencamera_req, xencamera_resp>
 {
 public:
-    CtrlRingBuffer(EventRingBufferPtr eventBuffer, domid_t domId,
-                   evtchn_port_t port, grant_ref_t ref,
-                   std::string ctrls, CameraHandlerPtr cameraHandler);
+    CtrlRingBuffer(GrantMapperPtr mapper, EventRingBufferPtr eventBuffer,
+                   domid_t domId, evtchn_port_t port, grant_ref_t ref,
+                   std::string ctrls, CameraHandlerPtr cameraHandler,
+                   const Config::BackendConfig& config,
+                   SharedBuffersPublisher publisher = nullptr);
+    ~CtrlRingBuffer();
 
 private:
     CommandHandler mCommandHandler;
 
     XenBackend::Log mLog;
 
+    /* Protects the ring from responses sent by the worker. */
+    std::mutex mResponseLock;
+
+    std::mutex mLock;
+    std::condition_variable mCondition;
+    std::thread mThread;
+    bool mTerminate;
+
+    /* Requests for the worker, including the one being handled. */
+    std::deque<xencamera_req> mPending;
+    int mPendingBufOps;
+
     virtual void processRequest(const xencamera_req& req) override;
+
+    bool isAsync(const xencamera_req& req);
+    void handleRequest(const xencamera_req& req);
+    void handleCtrlSet(const std::vector<xencamera_req>& reqs);
+    void workerThread();
 };
 
 typedef std::shared_ptr<CtrlRingBuffer> CtrlRingBufferPtr;
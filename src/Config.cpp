@@ -16,6 +16,7 @@ using libconfig::FileIOException;
 using libconfig::ParseException;
 using libconfig::SettingException;
 using libconfig::SettingNotFoundException;
+using libconfig::SettingTypeException;
 
 Config::Config(string fileName):
     mLog("Config")
@@ -30,12 +31,16 @@ Config::Config(string fileName):
         LOG(mLog, DEBUG) << "Open file: " << cfgName;
 
         mConfig.readFile(cfgName);
-
-        readPipelineConfig(mPipelineConfig);
     }
     catch(const FileIOException& e)
     {
-        throw ConfigException("Config: can't open file: " + string(cfgName));
+        /*
+         * The configuration file is optional: it is only required if
+         * there are cameras with media pipelines, which is checked when
+         * the pipeline configuration is requested.
+         */
+        LOG(mLog, WARNING) << "Can't open file: " << cfgName <<
+            ", using defaults";
     }
     catch(const ParseException& e)
     {
@@ -43,34 +48,325 @@ Config::Config(string fileName):
                               ", file: " + string(e.getFile()) +
                               ", line: " + to_string(e.getLine()));
     }
+
+    readPipelineConfig(mPipelineConfig);
+    readBackendConfig(mBackendConfig);
+    readCameraConfig(mCameraConfig);
+    readDomainConfig(mDomainConfig);
+}
+
+Config::CameraConfig Config::getCameraConfig(const string& videoId)
+{
+    auto it = mCameraConfig.find(videoId);
+
+    if (it == mCameraConfig.end())
+        return CameraConfig();
+
+    return it->second;
 }
 
-void Config::readPipelineConfig(PipelineConfig& config)
+Config::DomainConfig Config::getDomainConfig(int domId)
+{
+    auto it = mDomainConfig.find(domId);
+
+    if (it == mDomainConfig.end())
+        return DomainConfig();
+
+    return it->second;
+}
+
+const Config::PipelineConfig& Config::getPipelineConfig(const string& videoId,
+                                                        const string& mediaId)
+{
+    for (auto const& key : { videoId + ":" + mediaId, videoId + ":",
+                             ":" + mediaId, string(":") }) {
+        auto it = mPipelineConfig.find(key);
+
+        if (it != mPipelineConfig.end())
+            return it->second;
+    }
+
+    throw ConfigException("Config: no mediactl for " + videoId + ":" +
+                          mediaId);
+}
+
+/*
+ * Pipelines are keyed by "video-id:media-id" where either of the ids
+ * may be empty if the pipeline is not bound to it.
+ */
+void Config::readPipelineConfig(std::unordered_map<string, PipelineConfig>& config)
 {
     string sectionName = "mediactl";
 
+    config.clear();
+
+    if (!mConfig.exists(sectionName)) {
+        LOG(mLog, DEBUG) << "No media pipeline configuration";
+        return;
+    }
+
     try
     {
-        config.link1.clear();
-        config.link2.clear();
-        config.source_fmt.clear();
-        config.sink_fmt.clear();
-
         Setting& setting = mConfig.lookup(sectionName);
 
-        config.link1 = static_cast<const char*>(setting.lookup("link1"));
-        config.link2 = static_cast<const char*>(setting.lookup("link2"));
-        config.source_fmt = static_cast<const char*>(setting.lookup("source_fmt"));
-        config.sink_fmt = static_cast<const char*>(setting.lookup("sink_fmt"));
+        /* Single pipeline for all cameras. */
+        if (setting.isGroup()) {
+            readPipelineEntry(setting, config[":"]);
+            return;
+        }
+
+        for (int i = 0; i < setting.getLength(); i++) {
+            Setting& pipeline = setting[i];
+            string videoId, mediaId;
+
+            pipeline.lookupValue("video_id", videoId);
+            pipeline.lookupValue("media_id", mediaId);
 
-        LOG(mLog, DEBUG) << "Media pipeline configuration";
-        LOG(mLog, DEBUG) << "link1:      " << config.link1;
-        LOG(mLog, DEBUG) << "link2:      " << config.link2;
-        LOG(mLog, DEBUG) << "source_fmt: " << config.source_fmt;
-        LOG(mLog, DEBUG) << "sink_fmt:   " << config.sink_fmt;
+            string key = videoId + ":" + mediaId;
+
+            if (config.find(key) != config.end())
+                throw ConfigException("Config: duplicate mediactl for " + key);
+
+            readPipelineEntry(pipeline, config[key]);
+        }
     }
     catch(const SettingNotFoundException& e)
     {
         throw ConfigException(string("Config: error reading ") + sectionName);
     }
+    catch(const SettingTypeException& e)
+    {
+        throw ConfigException(string("Config: wrong setting type in ") +
+                              sectionName);
+    }
+}
+
+void Config::readPipelineEntry(Setting& setting, PipelineConfig& config)
+{
+    auto readList = [&setting](const char* name,
+                               std::vector<string>& values) {
+        if (!setting.exists(name))
+            return;
+
+        Setting& list = setting[name];
+
+        for (int i = 0; i < list.getLength(); i++)
+            values.push_back(static_cast<const char*>(list[i]));
+    };
+
+    readList("links", config.links);
+    readList("formats", config.formats);
+
+    /* Legacy fixed settings. */
+    for (auto name : { "link1", "link2" })
+        if (setting.exists(name))
+            config.links.push_back(static_cast<const char*>(setting[name]));
+
+    for (auto name : { "source_fmt", "sink_fmt" })
+        if (setting.exists(name))
+            config.formats.push_back(static_cast<const char*>(setting[name]));
+
+    if (config.links.empty())
+        throw ConfigException("Config: no links in mediactl");
+
+    LOG(mLog, DEBUG) << "Media pipeline configuration";
+
+    for (auto const& link : config.links)
+        LOG(mLog, DEBUG) << "link:   " << link;
+
+    for (auto const& format : config.formats)
+        LOG(mLog, DEBUG) << "format: " << format;
+}
+
+void Config::readBackendConfig(BackendConfig& config)
+{
+    string sectionName = "backend";
+
+    config = BackendConfig();
+
+    if (!mConfig.exists(sectionName))
+        return;
+
+    try
+    {
+        Setting& setting = mConfig.lookup(sectionName);
+
+        if (setting.exists("prewarm")) {
+            Setting& prewarm = setting["prewarm"];
+
+            for (int i = 0; i < prewarm.getLength(); i++)
+                config.prewarm.push_back(static_cast<const char*>(prewarm[i]));
+        }
+
+        setting.lookupValue("linger_ms", config.lingerMs);
+        setting.lookupValue("linger_stream", config.lingerStream);
+        setting.lookupValue("ctrl_event_interval_ms",
+                            config.ctrlEventIntervalMs);
+        setting.lookupValue("grant_cache_mb", config.grantCacheMb);
+        setting.lookupValue("grant_copy", config.grantCopy);
+        setting.lookupValue("shared_buffers", config.sharedBuffers);
+        setting.lookupValue("reactor_threads", config.reactorThreads);
+        setting.lookupValue("worker_threads", config.workerThreads);
+
+        readThreadConfig(setting, "reactor_thread", config.reactorThread);
+        readThreadConfig(setting, "worker_thread", config.workerThread);
+
+        LOG(mLog, DEBUG) << "Backend configuration";
+
+        for (auto const& uniqueId : config.prewarm)
+            LOG(mLog, DEBUG) << "prewarm:       " << uniqueId;
+
+        LOG(mLog, DEBUG) << "linger_ms:     " << config.lingerMs;
+        LOG(mLog, DEBUG) << "linger_stream: " << config.lingerStream;
+        LOG(mLog, DEBUG) << "ctrl_event_interval_ms: " <<
+            config.ctrlEventIntervalMs;
+        LOG(mLog, DEBUG) << "grant_cache_mb: " << config.grantCacheMb;
+        LOG(mLog, DEBUG) << "grant_copy:    " << config.grantCopy;
+        LOG(mLog, DEBUG) << "shared_buffers: " << config.sharedBuffers;
+        LOG(mLog, DEBUG) << "reactor_threads: " << config.reactorThreads;
+        LOG(mLog, DEBUG) << "worker_threads: " << config.workerThreads;
+    }
+    catch(const SettingTypeException& e)
+    {
+        throw ConfigException(string("Config: wrong setting type in ") +
+                              sectionName);
+    }
+}
+
+void Config::readCameraConfig(std::unordered_map<string, CameraConfig>& config)
+{
+    string sectionName = "cameras";
+
+    config.clear();
+
+    if (!mConfig.exists(sectionName))
+        return;
+
+    try
+    {
+        Setting& setting = mConfig.lookup(sectionName);
+
+        for (int i = 0; i < setting.getLength(); i++) {
+            Setting& camera = setting[i];
+            CameraConfig cameraConfig;
+
+            string videoId = static_cast<const char*>(camera.lookup("id"));
+
+            camera.lookupValue("speculative_start",
+                               cameraConfig.speculativeStart);
+            camera.lookupValue("idle_timeout_ms", cameraConfig.idleTimeoutMs);
+            camera.lookupValue("idle_hysteresis_ms",
+                               cameraConfig.idleHysteresisMs);
+            camera.lookupValue("watchdog_frames", cameraConfig.watchdogFrames);
+
+            readThreadConfig(camera, "thread", cameraConfig.thread);
+            camera.lookupValue("busy_poll_us", cameraConfig.busyPollUs);
+
+            LOG(mLog, DEBUG) << "Camera configuration: " << videoId;
+            LOG(mLog, DEBUG) << "speculative_start:  " <<
+                cameraConfig.speculativeStart;
+            LOG(mLog, DEBUG) << "idle_timeout_ms:    " <<
+                cameraConfig.idleTimeoutMs;
+            LOG(mLog, DEBUG) << "idle_hysteresis_ms: " <<
+                cameraConfig.idleHysteresisMs;
+            LOG(mLog, DEBUG) << "watchdog_frames:    " <<
+                cameraConfig.watchdogFrames;
+
+            config[videoId] = cameraConfig;
+        }
+    }
+    catch(const SettingNotFoundException& e)
+    {
+        throw ConfigException(string("Config: camera id is missing in ") +
+                              sectionName);
+    }
+    catch(const SettingTypeException& e)
+    {
+        throw ConfigException(string("Config: wrong setting type in ") +
+                              sectionName);
+    }
+}
+
+void Config::readDomainConfig(std::unordered_map<int, DomainConfig>& config)
+{
+    string sectionName = "domains";
+
+    config.clear();
+
+    if (!mConfig.exists(sectionName))
+        return;
+
+    try
+    {
+        Setting& setting = mConfig.lookup(sectionName);
+
+        for (int i = 0; i < setting.getLength(); i++) {
+            Setting& domain = setting[i];
+            DomainConfig domainConfig;
+
+            int domId = domain.lookup("id");
+
+            domain.lookupValue("max_fps", domainConfig.maxFps);
+            domain.lookupValue("max_bytes_per_sec",
+                               domainConfig.maxBytesPerSec);
+
+            LOG(mLog, DEBUG) << "Domain configuration: " << domId;
+            LOG(mLog, DEBUG) << "max_fps:           " << domainConfig.maxFps;
+            LOG(mLog, DEBUG) << "max_bytes_per_sec: " <<
+                domainConfig.maxBytesPerSec;
+
+            config[domId] = domainConfig;
+        }
+    }
+    catch(const SettingNotFoundException& e)
+    {
+        throw ConfigException(string("Config: domain id is missing in ") +
+                              sectionName);
+    }
+    catch(const SettingTypeException& e)
+    {
+        throw ConfigException(string("Config: wrong setting type in ") +
+                              sectionName);
+    }
+}
+
+/*
+ * Thread settings are a group:
+ * { cpus = [ 4, 5 ]; policy = "fifo"; priority = 50; name = "cam0"; }
+ */
+void Config::readThreadConfig(Setting& setting, const string& name,
+                              ThreadConfig& config)
+{
+    if (!setting.exists(name))
+        return;
+
+    Setting& thread = setting[name.c_str()];
+
+    if (thread.exists("cpus")) {
+        Setting& cpus = thread["cpus"];
+
+        for (int i = 0; i < cpus.getLength(); i++)
+            config.cpus.push_back(cpus[i]);
+    }
+
+    string policy;
+
+    if (thread.lookupValue("policy", policy)) {
+        if (policy == "other")
+            config.policy = SCHED_OTHER;
+        else if (policy == "fifo")
+            config.policy = SCHED_FIFO;
+        else if (policy == "rr")
+            config.policy = SCHED_RR;
+        else
+            throw ConfigException("Config: wrong scheduling policy " +
+                                  policy + " in " + name);
+    }
+
+    thread.lookupValue("priority", config.priority);
+    thread.lookupValue("name", config.name);
+
+    LOG(mLog, DEBUG) << name << ": policy " << config.policy <<
+        ", priority " << config.priority << ", cpus " << config.cpus.size() <<
+        ", name " << config.name;
 }
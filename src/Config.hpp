@@ -12,11 +12,15 @@
 #include <exception>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <libconfig.h++>
 
 #include <xen/be/Log.hpp>
 
+#include "ThreadConfig.hpp"
+
 /***************************************************************************//**
  * Exception generated by Config class.
  * @ingroup config
@@ -47,21 +51,115 @@ public:
 
     /*
      * Media pipeline configuration:
-     * link - link descriptor to setup in the pipeline which is exactly
-     *        the same string as one being passed to media-ctl utility
-     *        using "-l" option.
-     * x_fmt - format to propagate in the pipeline which is exactly
-     *         the same string as one being passed to media-ctl utility
-     *         using "-V" option.
+     * links - link descriptors to setup in the pipeline which are exactly
+     *         the same strings as ones being passed to media-ctl utility
+     *         using "-l" option.
+     * formats - formats to propagate in the pipeline which are exactly
+     *           the same strings as ones being passed to media-ctl utility
+     *           using "-V" option, applied in order.
      */
     struct PipelineConfig {
-        std::string link1;
-        std::string link2;
-        std::string source_fmt;
-        std::string sink_fmt;
+        std::vector<std::string> links;
+        std::vector<std::string> formats;
+
+        bool operator==(const PipelineConfig& other) const {
+            return links == other.links && formats == other.formats;
+        }
+    };
+
+    /*
+     * Pipeline of the camera: the one configured for the video-id and
+     * media-id pair is preferred, then for the video-id, then for the
+     * media-id, then the pipeline with no ids.
+     */
+    const PipelineConfig& getPipelineConfig(const std::string& videoId,
+                                            const std::string& mediaId);
+
+    /*
+     * Backend configuration:
+     * prewarm - unique-ids of the cameras to open and configure when
+     *           the backend starts, before any frontend binds.
+     * lingerMs - time to keep a camera handler, its buffers and
+     *            configuration after the last frontend has gone,
+     *            0 disables lingering.
+     * lingerStream - also keep the camera streaming while lingering.
+     * ctrlEventIntervalMs - minimum interval between control change
+     *                       events of the same control sent to a frontend,
+     *                       only the latest value is sent, 0 disables
+     *                       coalescing.
+     * grantCacheMb - per frontend limit of the buffer mappings kept after
+     *                the buffers are destroyed, for the buffers created
+     *                again with the same grant references, 0 disables
+     *                the cache. Only useful with frontends which reuse
+     *                the grant references of their buffers. Mappings are
+     *                dropped when the frontend starts streaming.
+     * grantCopy - write frames to the frontend buffers with grant copy
+     *             instead of keeping the buffers mapped.
+     * sharedBuffers - let the frontends which request it read the frames
+     *                 in place from the camera buffers, see SharedBuffers,
+     *                 if they are alone on the camera.
+     * reactorThreads - number of threads waiting for the frames, control
+     *                  events and watchdog timers of all the cameras,
+     *                  0 runs threads per camera instead.
+     * workerThreads - number of threads copying the frames to the frontends
+     *                 for all the cameras, 0 copies on the thread which has
+     *                 got the frame.
+     * reactorThread, workerThread - placement and scheduling of the reactor
+     *                               and worker threads.
+     */
+    struct BackendConfig {
+        std::vector<std::string> prewarm;
+        int lingerMs = 0;
+        bool lingerStream = false;
+        int ctrlEventIntervalMs = 50;
+        int grantCacheMb = 0;
+        bool grantCopy = false;
+        bool sharedBuffers = false;
+        int reactorThreads = 0;
+        int workerThreads = 0;
+        ThreadConfig reactorThread;
+        ThreadConfig workerThread;
     };
 
-    const PipelineConfig& getPipelineConfig() { return mPipelineConfig; }
+    const BackendConfig& getBackendConfig() { return mBackendConfig; }
+
+    /*
+     * Camera configuration, per video-id:
+     * speculativeStart - start streaming as soon as the buffers are
+     *                    requested and keep the latest frame, so the
+     *                    first frame is delivered right on stream start.
+     * idleTimeoutMs - pause streaming if no frontend has had buffers to
+     *                 fill for this time, 0 disables pausing.
+     * idleHysteresisMs - minimum time to stream after the stream has been
+     *                    (re)started before it can be paused.
+     * watchdogFrames - restart the stream if no frame has been captured
+     *                  for this number of frame intervals, 0 disables it.
+     * thread - placement and scheduling of the capture thread.
+     * busyPollUs - spin on dequeueing the frame from this time before it
+     *              is expected, 0 disables busy polling.
+     */
+    struct CameraConfig {
+        bool speculativeStart = false;
+        int idleTimeoutMs = 0;
+        int idleHysteresisMs = 1000;
+        int watchdogFrames = 0;
+        ThreadConfig thread;
+        int busyPollUs = 0;
+    };
+
+    CameraConfig getCameraConfig(const std::string& videoId);
+
+    /*
+     * Quota of a frontend domain, per camera:
+     * maxFps - maximum frames per second delivered, 0 is unlimited.
+     * maxBytesPerSec - maximum bytes per second delivered, 0 is unlimited.
+     */
+    struct DomainConfig {
+        int maxFps = 0;
+        int maxBytesPerSec = 0;
+    };
+
+    DomainConfig getDomainConfig(int domId);
 
     Config(Config&&) = delete;
     Config(const Config&) = delete;
@@ -73,8 +171,23 @@ private:
     XenBackend::Log mLog;
     libconfig::Config mConfig;
 
-    void readPipelineConfig(PipelineConfig& config);
-    PipelineConfig mPipelineConfig;
+    void readPipelineConfig(
+        std::unordered_map<std::string, PipelineConfig>& config);
+    void readPipelineEntry(libconfig::Setting& setting,
+                           PipelineConfig& config);
+    std::unordered_map<std::string, PipelineConfig> mPipelineConfig;
+
+    void readBackendConfig(BackendConfig& config);
+    BackendConfig mBackendConfig;
+
+    void readCameraConfig(std::unordered_map<std::string, CameraConfig>& config);
+
+    void readThreadConfig(libconfig::Setting& setting, const std::string& name,
+                          ThreadConfig& config);
+    std::unordered_map<std::string, CameraConfig> mCameraConfig;
+
+    void readDomainConfig(std::unordered_map<int, DomainConfig>& config);
+    std::unordered_map<int, DomainConfig> mDomainConfig;
 };
 
 typedef std::shared_ptr<Config> ConfigPtr;
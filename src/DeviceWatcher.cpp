@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <climits>
+
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include <xen/be/Exception.hpp>
+
+#include "DeviceWatcher.hpp"
+
+using XenBackend::Exception;
+using XenBackend::PollFd;
+
+DeviceWatcher::DeviceWatcher(const std::string& dirName, DeviceCallback clb):
+    mLog("DeviceWatcher"),
+    mDirName(dirName),
+    mCallback(clb),
+    mFd(-1),
+    mWd(-1)
+{
+    try {
+        init();
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+DeviceWatcher::~DeviceWatcher()
+{
+    release();
+}
+
+void DeviceWatcher::init()
+{
+    LOG(mLog, DEBUG) << "Watching devices in " << mDirName;
+
+    mFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if (mFd < 0)
+        throw Exception("Failed to initialize inotify", errno);
+
+    /*
+     * The node is created by udev before its permissions are set up,
+     * so the node is only reported when its attributes change as well.
+     */
+    mWd = inotify_add_watch(mFd, mDirName.c_str(),
+                            IN_CREATE | IN_ATTRIB | IN_DELETE);
+
+    if (mWd < 0)
+        throw Exception("Failed to watch " + mDirName, errno);
+
+    mPollFd.reset(new PollFd(mFd, POLLIN));
+
+    mThread = std::thread(&DeviceWatcher::eventThread, this);
+}
+
+void DeviceWatcher::release()
+{
+    if (mThread.joinable()) {
+        mPollFd->stop();
+        mThread.join();
+    }
+
+    mPollFd.reset();
+
+    if (mFd >= 0)
+        ::close(mFd);
+
+    mFd = -1;
+    mWd = -1;
+}
+
+void DeviceWatcher::eventThread()
+{
+    try {
+        while (mPollFd->poll())
+            processEvents();
+    } catch(const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+}
+
+void DeviceWatcher::processEvents()
+{
+    alignas(inotify_event) char buf[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+
+    while (true) {
+        ssize_t len = ::read(mFd, buf, sizeof(buf));
+
+        if (len < 0) {
+            if (errno == EAGAIN)
+                return;
+
+            if (errno == EINTR)
+                continue;
+
+            throw Exception("Failed to read inotify events", errno);
+        }
+
+        for (char *ptr = buf; ptr < buf + len; ) {
+            auto event = reinterpret_cast<inotify_event *>(ptr);
+
+            ptr += sizeof(inotify_event) + event->len;
+
+            if (!event->len || (event->mask & IN_ISDIR))
+                continue;
+
+            std::string name(event->name);
+            bool added = !(event->mask & IN_DELETE);
+
+            DLOG(mLog, DEBUG) << "Device " << name <<
+                (added ? " appeared" : " disappeared");
+
+            if (mCallback)
+                mCallback(name, added);
+        }
+    }
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_DEVICEWATCHER_HPP_
+#define SRC_DEVICEWATCHER_HPP_
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <xen/be/Log.hpp>
+#include <xen/be/Utils.hpp>
+
+/*
+ * Watches the device directory for the device nodes appearing and
+ * disappearing, e.g. on USB camera being plugged in or out.
+ */
+class DeviceWatcher
+{
+public:
+    /* node name, e.g. "video0"; true if the node has appeared */
+    typedef std::function<void(const std::string&, bool)> DeviceCallback;
+
+    DeviceWatcher(const std::string& dirName, DeviceCallback clb);
+    ~DeviceWatcher();
+
+private:
+    XenBackend::Log mLog;
+
+    std::string mDirName;
+    DeviceCallback mCallback;
+
+    int mFd;
+    int mWd;
+
+    std::unique_ptr<XenBackend::PollFd> mPollFd;
+    std::thread mThread;
+
+    void init();
+    void release();
+
+    void eventThread();
+    void processEvents();
+};
+
+typedef std::unique_ptr<DeviceWatcher> DeviceWatcherPtr;
+
+#endif /* SRC_DEVICEWATCHER_HPP_ */
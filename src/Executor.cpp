@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include "Executor.hpp"
+
+const size_t Executor::cQueueSize;
+
+Executor::Executor(int numThreads, const ThreadConfig& threadConfig):
+    mLog("Executor"),
+    mTerminate(false),
+    mNumQueued(0),
+    mNextQueue(0),
+    mThreadConfig(threadConfig)
+{
+    try {
+        init(numThreads);
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+Executor::~Executor()
+{
+    release();
+}
+
+void Executor::init(int numThreads)
+{
+    LOG(mLog, DEBUG) << "Create executor, threads: " << numThreads;
+
+    for (int i = 0; i < numThreads; i++) {
+        std::unique_ptr<Queue> queue(new Queue);
+
+        queue->head = 0;
+        queue->size = 0;
+
+        mQueues.push_back(std::move(queue));
+    }
+
+    for (int i = 0; i < numThreads; i++)
+        mThreads.push_back(std::thread(&Executor::workerThread, this, i));
+}
+
+void Executor::release()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mTerminate = true;
+    }
+
+    mCondition.notify_all();
+
+    for (auto& thread : mThreads)
+        if (thread.joinable())
+            thread.join();
+
+    mThreads.clear();
+}
+
+bool Executor::push(size_t queue, const Item& item)
+{
+    auto& q = *mQueues[queue];
+    std::lock_guard<std::mutex> lock(q.lock);
+
+    if (q.size == cQueueSize)
+        return false;
+
+    q.items[(q.head + q.size) % cQueueSize] = item;
+    q.size++;
+    mNumQueued++;
+
+    return true;
+}
+
+/*
+ * Take the oldest task from the worker's own queue.
+ */
+bool Executor::pop(size_t queue, Item& item)
+{
+    auto& q = *mQueues[queue];
+    std::lock_guard<std::mutex> lock(q.lock);
+
+    if (!q.size)
+        return false;
+
+    item = q.items[q.head];
+    q.head = (q.head + 1) % cQueueSize;
+    q.size--;
+    mNumQueued--;
+
+    return true;
+}
+
+/*
+ * Take the newest task from any queue, but the thief's own one. If job is
+ * given, then only its tasks are taken.
+ */
+bool Executor::steal(size_t queue, Item& item, Job *job)
+{
+    for (size_t i = 1; i <= mQueues.size(); i++) {
+        size_t victim = (queue + i) % mQueues.size();
+
+        if (victim == queue)
+            continue;
+
+        auto& q = *mQueues[victim];
+        std::lock_guard<std::mutex> lock(q.lock);
+
+        if (!q.size)
+            continue;
+
+        auto& last = q.items[(q.head + q.size - 1) % cQueueSize];
+
+        if (job && last.job != job)
+            continue;
+
+        item = last;
+        q.size--;
+        mNumQueued--;
+
+        return true;
+    }
+
+    return false;
+}
+
+void Executor::execute(Item& item)
+{
+    auto job = item.job;
+
+    if (std::chrono::steady_clock::now() > job->deadline) {
+        job->skipped++;
+    } else {
+        try {
+            (*job->task)(item.index);
+        } catch(const std::exception& e) {
+            LOG(mLog, ERROR) << e.what();
+        }
+    }
+
+    /* The job is gone as soon as the last task is done. */
+    if (--job->pending == 0) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mDoneCondition.notify_all();
+    }
+}
+
+size_t Executor::run(size_t count, const Task& task,
+                     std::chrono::steady_clock::time_point deadline)
+{
+    if (!count)
+        return 0;
+
+    Job job;
+
+    job.task = &task;
+    job.deadline = deadline;
+    job.pending = count;
+    job.skipped = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        Item item { .job = &job, .index = i };
+
+        /* All the queues are full: do it right away. */
+        if (!push(mNextQueue++ % mQueues.size(), item))
+            execute(item);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mCondition.notify_all();
+    }
+
+    /* Help with the job instead of just waiting for it. */
+    while (job.pending) {
+        Item item;
+
+        if (steal(mQueues.size(), item, &job)) {
+            execute(item);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mLock);
+
+        mDoneCondition.wait(lock, [&job] { return job.pending == 0; });
+    }
+
+    return job.skipped;
+}
+
+void Executor::workerThread(size_t id)
+{
+    auto threadConfig = mThreadConfig;
+
+    if (!threadConfig.name.empty())
+        threadConfig.name += "-" + std::to_string(id);
+
+    threadConfig.apply("cam-worker-" + std::to_string(id));
+
+    while (true) {
+        Item item;
+
+        if (pop(id, item) || steal(id, item, nullptr)) {
+            execute(item);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mLock);
+
+        mCondition.wait(lock, [this] {
+            return mTerminate || mNumQueued > 0;
+        });
+
+        if (mTerminate)
+            break;
+    }
+}
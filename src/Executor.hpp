@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_EXECUTOR_HPP_
+#define SRC_EXECUTOR_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <xen/be/Log.hpp>
+
+#include "ThreadConfig.hpp"
+
+/*
+ * Pool of worker threads shared by all the cameras to spread per frame
+ * work, e.g. copying the frame to every frontend, over the CPUs.
+ * Every worker has its own queue and steals from the others' queues when
+ * its own is empty. Queues are of fixed size, so running tasks does not
+ * allocate memory.
+ */
+class Executor
+{
+public:
+    /* index of the task within the job */
+    typedef std::function<void(size_t)> Task;
+
+    Executor(int numThreads, const ThreadConfig& threadConfig);
+    ~Executor();
+
+    /*
+     * Run task for every index in [0, count) and wait for all of them to
+     * complete: the calling thread runs the tasks as well while waiting.
+     * Tasks not started by the deadline are skipped, the number of skipped
+     * tasks is returned.
+     */
+    size_t run(size_t count, const Task& task,
+               std::chrono::steady_clock::time_point deadline);
+
+private:
+    static const size_t cQueueSize = 64;
+
+    struct Job {
+        const Task *task;
+        std::chrono::steady_clock::time_point deadline;
+        std::atomic<size_t> pending;
+        std::atomic<size_t> skipped;
+    };
+
+    struct Item {
+        Job *job;
+        size_t index;
+    };
+
+    struct Queue {
+        std::mutex lock;
+        Item items[cQueueSize];
+        size_t head;
+        size_t size;
+    };
+
+    XenBackend::Log mLog;
+    std::mutex mLock;
+    std::condition_variable mCondition;
+    std::condition_variable mDoneCondition;
+    bool mTerminate;
+
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mThreads;
+    std::atomic<size_t> mNumQueued;
+    std::atomic<size_t> mNextQueue;
+
+    ThreadConfig mThreadConfig;
+
+    void init(int numThreads);
+    void release();
+
+    bool push(size_t queue, const Item& item);
+    bool pop(size_t queue, Item& item);
+    bool steal(size_t queue, Item& item, Job *job);
+    void execute(Item& item);
+
+    void workerThread(size_t id);
+};
+
+typedef std::shared_ptr<Executor> ExecutorPtr;
+
+#endif /* SRC_EXECUTOR_HPP_ */
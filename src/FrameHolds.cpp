@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+
+#include "FrameHolds.hpp"
+
+bool FrameHolds::hold(domid_t domId, int index)
+{
+    auto& holds = mHolds[domId];
+
+    if (mMaxHolds && holds.size() >= mMaxHolds)
+        return false;
+
+    if (std::find(holds.begin(), holds.end(), index) != holds.end())
+        return false;
+
+    if (static_cast<size_t>(index) >= mCounts.size())
+        mCounts.resize(index + 1);
+
+    /* Another frontend holding the same buffer costs the camera nothing. */
+    if (!mCounts[index]) {
+        if (mMaxHeld && mHeld >= mMaxHeld)
+            return false;
+
+        mHeld++;
+    }
+
+    mCounts[index]++;
+    holds.push_back(index);
+
+    return true;
+}
+
+bool FrameHolds::release(domid_t domId, int index)
+{
+    auto it = mHolds.find(domId);
+
+    if (it == mHolds.end())
+        return false;
+
+    auto& holds = it->second;
+    auto hold = std::find(holds.begin(), holds.end(), index);
+
+    if (hold == holds.end())
+        return false;
+
+    holds.erase(hold);
+    unhold(index);
+
+    return true;
+}
+
+std::vector<int> FrameHolds::releaseAll(domid_t domId)
+{
+    std::vector<int> released;
+
+    auto it = mHolds.find(domId);
+
+    if (it != mHolds.end()) {
+        released.swap(it->second);
+        mHolds.erase(it);
+    }
+
+    for (auto index : released)
+        unhold(index);
+
+    return released;
+}
+
+void FrameHolds::clear()
+{
+    mHolds.clear();
+    mCounts.clear();
+    mHeld = 0;
+}
+
+size_t FrameHolds::getHolds(int index) const
+{
+    if (static_cast<size_t>(index) >= mCounts.size())
+        return 0;
+
+    return mCounts[index];
+}
+
+void FrameHolds::unhold(int index)
+{
+    if (--mCounts[index] == 0)
+        mHeld--;
+}
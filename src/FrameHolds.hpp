@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_FRAMEHOLDS_HPP_
+#define SRC_FRAMEHOLDS_HPP_
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+#include <xen/xen.h>
+
+/***************************************************************************//**
+ * Camera buffers held by the frontends which read the frames in place:
+ * a frontend holds a buffer from the frame event till it queues the buffer
+ * back, the buffer can only be filled again when nobody holds it.
+ * A frontend holds a buffer at most once and only a limited number of
+ * buffers at a time, and only so many buffers are held by all of them
+ * together, so the camera always has a buffer to fill: slow frontends drop
+ * frames instead of stalling the camera for the others.
+ ******************************************************************************/
+class FrameHolds
+{
+public:
+    /*
+     * maxHolds - buffers a frontend may hold at a time,
+     * maxHeld - buffers held by all the frontends together, 0 - no limit.
+     */
+    explicit FrameHolds(size_t maxHolds = 0, size_t maxHeld = 0) :
+        mMaxHolds(maxHolds), mMaxHeld(maxHeld), mHeld(0) {}
+
+    /* Returns false if the frontend can't hold the buffer. */
+    bool hold(domid_t domId, int index);
+    /* Returns false if the frontend does not hold the buffer. */
+    bool release(domid_t domId, int index);
+    /* Releases all the buffers held by the frontend and returns them. */
+    std::vector<int> releaseAll(domid_t domId);
+    /* Forgets all the holds, e.g. when the buffers are freed. */
+    void clear();
+
+    /* Number of the frontends which hold the buffer. */
+    size_t getHolds(int index) const;
+    /* Number of the buffers held. */
+    size_t getHeld() const { return mHeld; }
+
+private:
+    size_t mMaxHolds;
+    size_t mMaxHeld;
+    std::unordered_map<domid_t, std::vector<int>> mHolds;
+    /* Holds per buffer index. */
+    std::vector<size_t> mCounts;
+    size_t mHeld;
+
+    void unhold(int index);
+};
+
+#endif /* SRC_FRAMEHOLDS_HPP_ */
@@ -12,49 +12,219 @@
 
 using XenBackend::Exception;
 
-FrontendBuffer::FrontendBuffer(domid_t domId, size_t size,
-                               const xencamera_req& req) :
-    mLog("FrontendBuffer"),
-    mDomId(domId)
+const size_t BufferMappingCache::cMaxEntries;
+
+BufferMappingCache::BufferMappingCache(GrantMapperPtr mapper, domid_t domId,
+                                       size_t maxSize) :
+    mLog("BufferMappingCache"),
+    mMapper(mapper),
+    mDomId(domId),
+    mMaxSize(maxSize),
+    mSize(0)
 {
-    LOG(mLog, DEBUG) << "Create camera buffer, domId " << std::to_string(domId);
+    LOG(mLog, DEBUG) << "Create buffer mapping cache, domId " <<
+        std::to_string(domId) << ", size " << maxSize;
+}
+
+BufferMappingCache::~BufferMappingCache()
+{
+    LOG(mLog, DEBUG) << "Delete buffer mapping cache, domId " <<
+        std::to_string(mDomId) << ", mappings " << mEntries.size();
+}
+
+/*
+ * Take the mapping of these references out of the cache if any,
+ * otherwise map them.
+ */
+GrantMappingPtr BufferMappingCache::get(const std::vector<grant_ref_t>& refs)
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto it = mIndex.find(refs);
+
+        if (it != mIndex.end()) {
+            auto buffer = std::move(it->second->second);
 
-    try {
-        init(req, size);
-    } catch (...) {
-        release();
-        throw;
+            mEntries.erase(it->second);
+            mIndex.erase(it);
+            mSize -= refs.size() * XC_PAGE_SIZE;
+
+            DLOG(mLog, DEBUG) << "Reuse mapping of " << refs.size() <<
+                " grefs, domId " << std::to_string(mDomId);
+
+            return buffer;
+        }
     }
+
+    return GrantMappingPtr(new GrantMapping(mMapper, refs.data(), refs.size(),
+                                            PROT_READ | PROT_WRITE));
 }
 
-FrontendBuffer::~FrontendBuffer()
+/*
+ * Keep the mapping of a destroyed buffer, unmap the least recently used
+ * ones which do not fit.
+ */
+void BufferMappingCache::put(const std::vector<grant_ref_t>& refs,
+                             GrantMappingPtr buffer)
 {
-    release();
+    size_t size = refs.size() * XC_PAGE_SIZE;
+
+    if (!buffer || size > mMaxSize)
+        return;
+
+    std::list<Entry> evicted;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        /* Same references are in use only once: should not happen. */
+        if (mIndex.count(refs))
+            return;
+
+        mEntries.emplace_front(refs, std::move(buffer));
+        mIndex[refs] = mEntries.begin();
+        mSize += size;
+
+        while (mSize > mMaxSize || mEntries.size() > cMaxEntries) {
+            auto& entry = mEntries.back();
+
+            mSize -= entry.first.size() * XC_PAGE_SIZE;
+            mIndex.erase(entry.first);
+            evicted.splice(evicted.end(), mEntries, std::prev(mEntries.end()));
+        }
+    }
+
+    /* Unmap the evicted buffers out of the lock. */
+    if (!evicted.empty())
+        DLOG(mLog, DEBUG) << "Evict " << evicted.size() <<
+            " mappings, domId " << std::to_string(mDomId);
 }
 
-void FrontendBuffer::init(const xencamera_req& req, size_t size)
+void BufferMappingCache::clear()
+{
+    std::list<Entry> evicted;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        evicted.swap(mEntries);
+        mIndex.clear();
+        mSize = 0;
+    }
+
+    /* Unmap out of the lock. */
+    if (!evicted.empty())
+        DLOG(mLog, DEBUG) << "Drop " << evicted.size() <<
+            " mappings, domId " << std::to_string(mDomId);
+}
+
+FrontendBuffer::FrontendBuffer(GrantMapperPtr mapper, domid_t domId,
+                               size_t size, const xencamera_req& req) :
+    mLog("FrontendBuffer"),
+    mMapper(mapper),
+    mDomId(domId)
 {
     const xencamera_buf_create_req& aReq = req.req.buf_create;
-    std::vector<grant_ref_t> refs;
+
+    LOG(mLog, DEBUG) << "Create camera buffer, domId " << std::to_string(domId);
 
     mIndex = aReq.index;
     mOffset = aReq.plane_offset[0];
+    mSize = size;
 
     /* Real size of the buffer will be bigger if there is offset. */
-    size += mOffset;
+    getBufferRefs(aReq.gref_directory, size + mOffset, mRefs);
+}
 
-    getBufferRefs(aReq.gref_directory, size, refs);
+FrontendBuffer::~FrontendBuffer()
+{
+    DLOG(mLog, DEBUG) << "Release buffer " << mIndex;
+}
 
-    mBuffer.reset(new XenBackend::XenGnttabBuffer(mDomId, refs.data(),
-                                                  refs.size(),
-                                                  PROT_READ | PROT_WRITE));
+/*
+ * The buffer might have been created for a different format, e.g.
+ * while the camera was not attached: never copy beyond its end.
+ */
+size_t FrontendBuffer::clampSize(size_t size)
+{
+    if (size > mSize) {
+        DLOG(mLog, WARNING) << "Frame of " << size <<
+            " bytes is truncated to buffer size " << mSize;
+        size = mSize;
+    }
+
+    return size;
 }
 
-void FrontendBuffer::release()
+MappedFrontendBuffer::MappedFrontendBuffer(GrantMapperPtr mapper,
+                                           domid_t domId, size_t size,
+                                           const xencamera_req& req,
+                                           BufferMappingCachePtr cache) :
+    FrontendBuffer(mapper, domId, size, req),
+    mCache(cache)
 {
-    DLOG(mLog, DEBUG) << "Release buffer " << mIndex;
+    if (mCache)
+        mBuffer = mCache->get(mRefs);
+    else
+        mBuffer.reset(new GrantMapping(mMapper, mRefs.data(), mRefs.size(),
+                                       PROT_READ | PROT_WRITE));
+}
+
+MappedFrontendBuffer::~MappedFrontendBuffer()
+{
+    if (mCache)
+        mCache->put(mRefs, std::move(mBuffer));
 }
 
+void MappedFrontendBuffer::copyBuffer(void *data, size_t size)
+{
+    DLOG(mLog, DEBUG) << "Copy, size: " << size;
+
+    size = clampSize(size);
+
+    memcpy(static_cast<uint8_t *>(mBuffer->get()) + mOffset, data, size);
+}
+
+CopyFrontendBuffer::CopyFrontendBuffer(GrantMapperPtr mapper, domid_t domId,
+                                       size_t size, const xencamera_req& req) :
+    FrontendBuffer(mapper, domId, size, req)
+{
+    /* A segment never crosses a page of the frontend. */
+    mSegments.resize(mRefs.size());
+}
+
+void CopyFrontendBuffer::copyBuffer(void *data, size_t size)
+{
+    DLOG(mLog, DEBUG) << "Grant copy, size: " << size;
+
+    size = clampSize(size);
+
+    uint32_t count = 0;
+    size_t pos = 0;
+
+    while (pos < size) {
+        size_t offset = (mOffset + pos) % XC_PAGE_SIZE;
+        size_t len = std::min(XC_PAGE_SIZE - offset, size - pos);
+        auto& segment = mSegments[count++];
+
+        segment.source.virt = static_cast<uint8_t *>(data) + pos;
+        segment.dest.foreign.ref = mRefs[(mOffset + pos) / XC_PAGE_SIZE];
+        segment.dest.foreign.offset = offset;
+        segment.dest.foreign.domid = mDomId;
+        segment.len = len;
+        segment.flags = GNTCOPY_dest_gref;
+        segment.status = GNTST_okay;
+
+        pos += len;
+    }
+
+    mMapper->copy(mSegments.data(), count);
+}
+
+static const size_t cGrefsPerDirectory =
+    (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
+        sizeof(uint32_t);
+
 void FrontendBuffer::getBufferRefs(grant_ref_t startDirectory, uint32_t size,
                                    std::vector<grant_ref_t>& refs)
 {
@@ -66,17 +236,23 @@ void FrontendBuffer::getBufferRefs(grant_ref_t startDirectory, uint32_t size,
         << ", size: " << size
         << ", in grefs: " << requestedNumGrefs;
 
-    while(startDirectory != 0)
-    {
+    refs.reserve(requestedNumGrefs);
 
-        XenBackend::XenGnttabBuffer pageBuffer(mDomId, startDirectory);
+    /*
+     * Only the first directory page is known up front, each next one is
+     * read from the page before, so the chain is followed page by page:
+     * the directory pages can't be mapped in one batch, as their grefs
+     * are not known ahead. Pages beyond the size of the buffer are never
+     * mapped.
+     */
+    while (startDirectory != 0 && requestedNumGrefs)
+    {
+        GrantMapping pageBuffer(mMapper, &startDirectory, 1, PROT_READ);
 
         xencamera_page_directory* pageDirectory =
             static_cast<xencamera_page_directory*>(pageBuffer.get());
 
-        size_t numGrefs = std::min(requestedNumGrefs,
-            (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
-                sizeof(uint32_t));
+        size_t numGrefs = std::min(requestedNumGrefs, cGrefsPerDirectory);
 
         DLOG(mLog, DEBUG) << "Gref address: " << pageDirectory->gref
             << ", numGrefs " << numGrefs;
@@ -91,11 +267,3 @@ void FrontendBuffer::getBufferRefs(grant_ref_t startDirectory, uint32_t size,
 
     DLOG(mLog, DEBUG) << "Get buffer refs, num refs: " << refs.size();
 }
-
-void FrontendBuffer::copyBuffer(void *data, size_t size)
-{
-    DLOG(mLog, DEBUG) << "Copy, size: " << size;
-
-    memcpy(static_cast<uint8_t *>(mBuffer->get()) + mOffset, data, size);
-}
-
@@ -8,42 +8,139 @@
 #ifndef SRC_FRONTENDBUFFER_HPP_
 #define SRC_FRONTENDBUFFER_HPP_
 
+#include <list>
+#include <map>
 #include <memory>
+#include <vector>
 
 #include <xen/be/Log.hpp>
-#include <xen/be/XenGnttab.hpp>
 
 #include <xen/io/cameraif.h>
 
+#include "GrantMapper.hpp"
+
+/***************************************************************************//**
+ * Mappings of the destroyed buffers of a frontend, keyed by their grant
+ * references, so a buffer created again with the same references reuses
+ * the mapping. Mappings are only kept while not in use, the least recently
+ * used are unmapped first when the size or the entry limit is exceeded.
+ * Only helps frontends which create the buffers again with the same grant
+ * references: a frontend can't end foreign access to the pages of a cached
+ * mapping, so e.g. Linux frontends grant new pages instead and the stale
+ * mappings keep their pages pinned until evicted.
+ * A destroyed buffer is only kept till the frontend starts streaming again,
+ * i.e. for the buffers recreated while the stream is reconfigured: the
+ * frontend must not find its pages still mapped later on.
+ ******************************************************************************/
+class BufferMappingCache
+{
+public:
+    BufferMappingCache(GrantMapperPtr mapper, domid_t domId, size_t maxSize);
+    ~BufferMappingCache();
+
+    GrantMappingPtr get(const std::vector<grant_ref_t>& refs);
+    void put(const std::vector<grant_ref_t>& refs, GrantMappingPtr buffer);
+    /* Unmap all the buffers kept. */
+    void clear();
+
+private:
+    typedef std::pair<std::vector<grant_ref_t>, GrantMappingPtr> Entry;
+
+    /* A couple of buffer sets, e.g. to survive a format change. */
+    static const size_t cMaxEntries = 8;
+
+    XenBackend::Log mLog;
+    std::mutex mLock;
+
+    GrantMapperPtr mMapper;
+    domid_t mDomId;
+    size_t mMaxSize;
+    size_t mSize;
+
+    /* Most recently used first. */
+    std::list<Entry> mEntries;
+    std::map<std::vector<grant_ref_t>, std::list<Entry>::iterator> mIndex;
+};
+
+typedef std::shared_ptr<BufferMappingCache> BufferMappingCachePtr;
+
+/***************************************************************************//**
+ * Frontend buffer the frames are delivered to. The grant references of the
+ * buffer are read from its page directory on creation, the way frames are
+ * written to the buffer is up to the implementation. All the grant
+ * operations go through the mapper of the frontend.
+ ******************************************************************************/
 class FrontendBuffer
 {
 public:
-    FrontendBuffer(domid_t domId, size_t size, const xencamera_req& req);
-    ~FrontendBuffer();
+    FrontendBuffer(GrantMapperPtr mapper, domid_t domId, size_t size,
+                   const xencamera_req& req);
+    virtual ~FrontendBuffer();
 
     int getIndex() {
         return mIndex;
     }
 
-    void copyBuffer(void *data, size_t size);
+    /* Write the frame to the frontend pages, throws on failure. */
+    virtual void copyBuffer(void *data, size_t size) = 0;
 
-private:
+    const std::vector<grant_ref_t>& getRefs() {
+        return mRefs;
+    }
+
+protected:
     XenBackend::Log mLog;
-    std::mutex mLock;
 
+    GrantMapperPtr mMapper;
     domid_t mDomId;
     int mIndex;
     unsigned long mOffset;
+    size_t mSize;
 
-    std::unique_ptr<XenBackend::XenGnttabBuffer> mBuffer;
+    std::vector<grant_ref_t> mRefs;
 
-    void init(const xencamera_req& req, size_t size);
-    void release();
+    size_t clampSize(size_t size);
 
+private:
     void getBufferRefs(grant_ref_t startDirectory, uint32_t size,
                        std::vector<grant_ref_t>& refs);
 };
 
+/***************************************************************************//**
+ * Buffer which is mapped for its whole life time, frames are copied
+ * with memcpy.
+ ******************************************************************************/
+class MappedFrontendBuffer : public FrontendBuffer
+{
+public:
+    MappedFrontendBuffer(GrantMapperPtr mapper, domid_t domId, size_t size,
+                         const xencamera_req& req,
+                         BufferMappingCachePtr cache = nullptr);
+    ~MappedFrontendBuffer();
+
+    void copyBuffer(void *data, size_t size) override;
+
+private:
+    GrantMappingPtr mBuffer;
+    BufferMappingCachePtr mCache;
+};
+
+/***************************************************************************//**
+ * Buffer which is never mapped: frames are written with grant copy
+ * operations, one per page of the buffer, issued in a single call.
+ ******************************************************************************/
+class CopyFrontendBuffer : public FrontendBuffer
+{
+public:
+    CopyFrontendBuffer(GrantMapperPtr mapper, domid_t domId, size_t size,
+                       const xencamera_req& req);
+
+    void copyBuffer(void *data, size_t size) override;
+
+private:
+    std::vector<xengnttab_grant_copy_segment_t> mSegments;
+};
+
 typedef std::unique_ptr<FrontendBuffer> FrontendBufferPtr;
 
 #endif /* SRC_FRONTENDBUFFER_HPP_ */
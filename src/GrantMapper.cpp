@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <xen/be/Exception.hpp>
+
+#include "GrantMapper.hpp"
+
+using XenBackend::Exception;
+
+XenGrantMapper::XenGrantMapper(domid_t domId) :
+    mLog("GrantMapper"),
+    mDomId(domId)
+{
+    mHandle = xengnttab_open(nullptr, 0);
+
+    if (!mHandle)
+        throw Exception("Can't open grant table device", errno);
+
+    LOG(mLog, DEBUG) << "Create grant mapper, domId " << std::to_string(domId);
+}
+
+XenGrantMapper::~XenGrantMapper()
+{
+    xengnttab_close(mHandle);
+}
+
+void *XenGrantMapper::map(const grant_ref_t *refs, size_t count, int prot)
+{
+    void *address = xengnttab_map_domain_grant_refs(mHandle, count, mDomId,
+        const_cast<grant_ref_t *>(refs), prot);
+
+    if (!address)
+        throw Exception("Can't map " + std::to_string(count) +
+                        " grefs, domId " + std::to_string(mDomId), errno);
+
+    return address;
+}
+
+void XenGrantMapper::unmap(void *address, size_t count)
+{
+    if (xengnttab_unmap(mHandle, address, count) < 0)
+        LOG(mLog, ERROR) << "Can't unmap " << count << " grefs, domId " <<
+            std::to_string(mDomId) << ", errno " << errno;
+}
+
+void XenGrantMapper::copy(xengnttab_grant_copy_segment_t *segments,
+                          size_t count)
+{
+    if (xengnttab_grant_copy(mHandle, count, segments) < 0)
+        throw Exception("Grant copy failed, domId " + std::to_string(mDomId),
+                        errno);
+
+    for (size_t i = 0; i < count; i++)
+        if (segments[i].status != GNTST_okay)
+            throw Exception("Grant copy failed, gref " +
+                            std::to_string(segments[i].dest.foreign.ref) +
+                            ", status " + std::to_string(segments[i].status) +
+                            ", domId " + std::to_string(mDomId), EIO);
+}
+
+GrantMapping::GrantMapping(GrantMapperPtr mapper, const grant_ref_t *refs,
+                           size_t count, int prot) :
+    mMapper(mapper),
+    mAddress(mapper->map(refs, count, prot)),
+    mCount(count)
+{
+}
+
+GrantMapping::~GrantMapping()
+{
+    mMapper->unmap(mAddress, mCount);
+}
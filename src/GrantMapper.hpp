@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_GRANTMAPPER_HPP_
+#define SRC_GRANTMAPPER_HPP_
+
+#include <memory>
+
+#include <xen/be/Log.hpp>
+#include <xen/be/XenGnttab.hpp>
+
+#include <xen/io/cameraif.h>
+
+extern "C" {
+#include <xengnttab.h>
+}
+
+/***************************************************************************//**
+ * Grant operations on the pages of a single frontend domain. There is one
+ * mapper per frontend, so all its buffers share the grant table handle,
+ * whether they are mapped or written with grant copy.
+ * Buffers only use the interface, so they can be run against a local
+ * stand-in, e.g. for benchmarks.
+ ******************************************************************************/
+class GrantMapper
+{
+public:
+    virtual ~GrantMapper() {}
+
+    /* Map the pages contiguously, throws on failure. */
+    virtual void *map(const grant_ref_t *refs, size_t count, int prot) = 0;
+    virtual void unmap(void *address, size_t count) = 0;
+
+    /* Copy the segments, throws if any of them fails. */
+    virtual void copy(xengnttab_grant_copy_segment_t *segments,
+                      size_t count) = 0;
+};
+
+typedef std::shared_ptr<GrantMapper> GrantMapperPtr;
+
+/***************************************************************************//**
+ * Grant operations through the grant table device.
+ ******************************************************************************/
+class XenGrantMapper : public GrantMapper
+{
+public:
+    explicit XenGrantMapper(domid_t domId);
+    ~XenGrantMapper();
+
+    void *map(const grant_ref_t *refs, size_t count, int prot) override;
+    void unmap(void *address, size_t count) override;
+    void copy(xengnttab_grant_copy_segment_t *segments,
+              size_t count) override;
+
+private:
+    XenBackend::Log mLog;
+
+    domid_t mDomId;
+    xengnttab_handle *mHandle;
+};
+
+/***************************************************************************//**
+ * Pages mapped with a grant mapper, unmapped on destruction.
+ ******************************************************************************/
+class GrantMapping
+{
+public:
+    GrantMapping(GrantMapperPtr mapper, const grant_ref_t *refs, size_t count,
+                 int prot);
+    ~GrantMapping();
+
+    GrantMapping(const GrantMapping&) = delete;
+    void operator = (const GrantMapping&) = delete;
+
+    void *get() const { return mAddress; }
+    size_t size() const { return mCount * XC_PAGE_SIZE; }
+
+private:
+    GrantMapperPtr mMapper;
+    void *mAddress;
+    size_t mCount;
+};
+
+typedef std::unique_ptr<GrantMapping> GrantMappingPtr;
+
+#endif /* SRC_GRANTMAPPER_HPP_ */
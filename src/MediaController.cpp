@@ -9,6 +9,11 @@
  * Copyright (C) 2020 EPAM Systems Inc.
  */
 
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
 #include <xen/be/Exception.hpp>
 #include "MediaController.hpp"
 
@@ -19,9 +24,12 @@ extern "C" {
 
 using XenBackend::Exception;
 
-MediaController::MediaController(std::string devName, ConfigPtr config):
+MediaController::MediaController(std::string devName, std::string videoId,
+                                 ConfigPtr config):
     mLog("MediaController"),
     mDevPath("/dev/" + devName),
+    mMediaId(devName),
+    mVideoId(videoId),
     mConfig(config)
 {
     try {
@@ -39,11 +47,22 @@ MediaController::~MediaController()
 
 void MediaController::init()
 {
-    int ret = -ENODEV;
-
     LOG(mLog, DEBUG) << "Initializing media device " << mDevPath;
 
-    const auto& config = mConfig->getPipelineConfig();
+    m_mediaDevice = mediaDeviceOpen();
+
+    showInfo();
+
+    setup(mConfig->getPipelineConfig(mVideoId, mMediaId));
+}
+
+/*
+ * Open and enumerate the media device: the entities and links, with their
+ * flags, are a snapshot of the device state at the time of enumeration.
+ */
+struct media_device *MediaController::mediaDeviceOpen()
+{
+    int ret = -ENODEV;
 
     auto throwIfFalse = [&, this](bool res, std::string&& sMsg, std::string dMsg) {
         if (!res) {
@@ -52,44 +71,336 @@ void MediaController::init()
         }
     };
 
-    m_mediaDevice = media_device_new(mDevPath.c_str());
-    throwIfFalse(m_mediaDevice != nullptr, "Failed to open device ", mDevPath);
+    auto mediaDevice = media_device_new(mDevPath.c_str());
+    throwIfFalse(mediaDevice != nullptr, "Failed to open device ", mDevPath);
+
+    ret = media_device_enumerate(mediaDevice);
+
+    if (ret)
+        media_device_unref(mediaDevice);
 
-    ret = media_device_enumerate(m_mediaDevice);
     throwIfFalse(!ret, "Failed to enumerate device ", mDevPath);
 
-    showInfo();
+    return mediaDevice;
+}
+
+void MediaController::release()
+{
+    LOG(mLog, DEBUG) << "Releasing media device " << mDevPath;
+
+    /*
+     * Links are left as they are: other video nodes of the same media
+     * device may still use them, and the next user of this pipeline
+     * finds it already set up.
+     */
+    if (m_mediaDevice)
+        media_device_unref(m_mediaDevice);
+}
+
+bool MediaController::pipelineMatches(ConfigPtr config)
+{
+    try {
+        return config->getPipelineConfig(mVideoId, mMediaId) == mPipeline;
+    } catch(const std::exception& e) {
+        LOG(mLog, WARNING) << e.what();
+    }
+
+    /* Keep the current pipeline if it is gone from the configuration. */
+    return true;
+}
+
+void MediaController::reconfigure(ConfigPtr config)
+{
+    LOG(mLog, DEBUG) << "Reconfiguring media device " << mDevPath;
 
-    ret = media_reset_links(m_mediaDevice);
-    throwIfFalse(!ret, "Failed to reset links", "");
+    mConfig = config;
 
-    ret = media_parse_setup_links(m_mediaDevice, config.link1.c_str());
-    throwIfFalse(!ret, "Failed to setup link1 ", config.link1);
+    /*
+     * Other pipelines of the same media device may have changed the links
+     * since they were enumerated: diff against their current state.
+     */
+    auto mediaDevice = mediaDeviceOpen();
+
+    media_device_unref(m_mediaDevice);
+    m_mediaDevice = mediaDevice;
+
+    setup(mConfig->getPipelineConfig(mVideoId, mMediaId));
+}
+
+/*
+ * Bring the pipeline to the configured state: the links and formats
+ * are compared with the current state of the media device and only
+ * those which differ are set up, so the device is not reset and other
+ * pipelines of the same device are not disturbed.
+ */
+void MediaController::setup(const Config::PipelineConfig& config)
+{
+    auto previous = std::move(mPipeline);
 
-    ret = media_parse_setup_links(m_mediaDevice, config.link2.c_str());
-    throwIfFalse(!ret, "Failed to setup link2 ", config.link2);
+    mPipeline = Config::PipelineConfig();
+
+    int ret = setupLinks(config.links, previous.links);
+
+    /*
+     * Some drivers only allow a single enabled link per sink, and links
+     * we know nothing about may still be in the way: start over from
+     * the default state of the device then, even though it disturbs
+     * other pipelines of the same device.
+     */
+    if (ret) {
+        LOG(mLog, WARNING) << "Can't reconcile links of media device " <<
+            mDevPath << ", resetting all links";
+
+        ret = media_reset_links(m_mediaDevice);
+
+        if (!ret)
+            ret = setupLinks(config.links, {});
+
+        if (ret)
+            throw Exception("Failed to configure media device " + mDevPath,
+                            -ret);
+    }
 
     /*
      * When the pipeline is configured it's time to propagate the format
      * to the video source/sink.
      */
-    ret = v4l2_subdev_parse_setup_formats(m_mediaDevice, config.source_fmt.c_str());
-    throwIfFalse(!ret, "Failed to setup source format ", config.source_fmt);
+    for (auto const& format : config.formats) {
+        if (formatsMatch(format)) {
+            DLOG(mLog, DEBUG) << "Format is already set: " << format;
+            continue;
+        }
+
+        int ret = v4l2_subdev_parse_setup_formats(m_mediaDevice,
+                                                  format.c_str());
+
+        if (ret) {
+            LOG(mLog, ERROR) << "Failed to setup format " << format;
+            throw Exception("Failed to configure media device " + mDevPath,
+                            -ret);
+        }
+    }
 
-    ret = v4l2_subdev_parse_setup_formats(m_mediaDevice, config.sink_fmt.c_str());
-    throwIfFalse(!ret, "Failed to setup sink format ", config.sink_fmt);
+    mPipeline = config;
 }
 
-void MediaController::release()
+/*
+ * Bring the links to the requested state, only setting up those which are
+ * not in that state yet. Enabled links of the previous pipeline which are
+ * not requested anymore are disabled first, as well as other enabled links
+ * to the sinks being linked, so the new links do not fail as busy.
+ * Returns 0 or negative error of the link which can't be set up.
+ */
+int MediaController::setupLinks(const std::vector<std::string>& links,
+                                const std::vector<std::string>& previousLinks)
 {
-    LOG(mLog, DEBUG) << "Releasing media device " << mDevPath;
+    std::vector<LinkSetup> setups;
+    std::vector<LinkSetup> previous;
 
-    if (m_mediaDevice) {
-        media_reset_links(m_mediaDevice);
-        media_device_unref(m_mediaDevice);
+    for (auto const& link : links)
+        parseLinks(link, setups);
+
+    for (auto const& link : previousLinks)
+        parseLinks(link, previous);
+
+    auto isRequested = [&setups](const struct media_link *link) {
+        for (auto const& setup : setups)
+            if (setup.link->source == link->source &&
+                setup.link->sink == link->sink)
+                return true;
+
+        return false;
+    };
+
+    for (auto const& setup : previous) {
+        if (!(setup.flags & MEDIA_LNK_FL_ENABLED) || isRequested(setup.link))
+            continue;
+
+        int ret = disableLink(setup.link);
+
+        if (ret)
+            return ret;
+    }
+
+    for (auto const& setup : setups) {
+        if (!(setup.flags & MEDIA_LNK_FL_ENABLED))
+            continue;
+
+        auto entity = setup.link->sink->entity;
+
+        for (unsigned int i = 0; i < media_entity_get_links_count(entity);
+             i++) {
+            auto other = media_entity_get_link(entity, i);
+
+            if (other->sink != setup.link->sink || isRequested(other))
+                continue;
+
+            int ret = disableLink(other);
+
+            if (ret)
+                return ret;
+        }
+    }
+
+    for (auto const& setup : setups) {
+        if ((setup.link->flags & MEDIA_LNK_FL_ENABLED) ==
+            (setup.flags & MEDIA_LNK_FL_ENABLED)) {
+            DLOG(mLog, DEBUG) << "Link is already set up";
+            continue;
+        }
+
+        int ret = media_setup_link(m_mediaDevice, setup.link->source,
+                                   setup.link->sink, setup.flags);
+
+        if (ret) {
+            LOG(mLog, ERROR) << "Failed to setup link, error " << ret;
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Disable the link unless it is disabled already or can't be changed.
+ */
+int MediaController::disableLink(const struct media_link *link)
+{
+    if (!(link->flags & MEDIA_LNK_FL_ENABLED) ||
+        (link->flags & MEDIA_LNK_FL_IMMUTABLE))
+        return 0;
+
+    DLOG(mLog, DEBUG) << "Disable link not in the pipeline";
+
+    int ret = media_setup_link(m_mediaDevice, link->source, link->sink,
+                               link->flags & ~MEDIA_LNK_FL_ENABLED);
+
+    if (ret)
+        LOG(mLog, ERROR) << "Failed to disable link, error " << ret;
+
+    return ret;
+}
+
+/*
+ * Parse the comma separated list of link descriptors, as accepted by
+ * media_parse_setup_links.
+ */
+void MediaController::parseLinks(const std::string& links,
+                                 std::vector<LinkSetup>& setups)
+{
+    const char *p = links.c_str();
+
+    while (*p) {
+        char *end;
+
+        auto link = media_parse_link(m_mediaDevice, p, &end);
+
+        if (!link)
+            throw Exception("Failed to parse link " + links, EINVAL);
+
+        p = end;
+        while (isspace(*p))
+            p++;
+
+        if (*p != '[')
+            throw Exception("No flags for link " + links, EINVAL);
+
+        uint32_t flags = strtoul(p + 1, &end, 10);
+
+        if (*end != ']')
+            throw Exception("Wrong flags for link " + links, EINVAL);
+
+        p = end + 1;
+        while (isspace(*p) || *p == ',')
+            p++;
+
+        setups.push_back({ .link = link, .flags = flags });
     }
 }
 
+/*
+ * Check if the comma separated list of pad formats, as accepted by
+ * v4l2_subdev_parse_setup_formats, is already set. Only media bus code,
+ * size and field are compared: if anything else is requested, then the
+ * formats are reported as different, so they are always set.
+ */
+bool MediaController::formatsMatch(const std::string& formats)
+{
+    const char *p = formats.c_str();
+
+    while (*p) {
+        char *end;
+
+        auto pad = media_parse_pad(m_mediaDevice, p, &end);
+
+        if (!pad)
+            return false;
+
+        p = end;
+        while (isspace(*p))
+            p++;
+
+        if (*p != '[')
+            return false;
+
+        auto close = strchr(p, ']');
+
+        if (!close)
+            return false;
+
+        std::istringstream tokens(std::string(p + 1, close));
+        std::string token;
+
+        v4l2_mbus_framefmt expected {0};
+        bool hasField = false;
+
+        while (tokens >> token) {
+            unsigned int width, height;
+            char code[32];
+
+            if (sscanf(token.c_str(), "fmt:%31[^/]/%ux%u",
+                       code, &width, &height) == 3) {
+                expected.code = v4l2_subdev_string_to_pixelcode(code);
+                expected.width = width;
+                expected.height = height;
+
+                if (expected.code == static_cast<uint32_t>(-1))
+                    return false;
+            } else if (token.compare(0, 6, "field:") == 0) {
+                expected.field = v4l2_subdev_string_to_field(
+                    token.c_str() + 6);
+                hasField = true;
+
+                if (expected.field == static_cast<uint32_t>(-1))
+                    return false;
+            } else {
+                return false;
+            }
+        }
+
+        if (!expected.code)
+            return false;
+
+        v4l2_mbus_framefmt current {0};
+
+        if (v4l2_subdev_get_format(pad->entity, &current, pad->index,
+                                   V4L2_SUBDEV_FORMAT_ACTIVE))
+            return false;
+
+        if (current.code != expected.code ||
+            current.width != expected.width ||
+            current.height != expected.height ||
+            (hasField && current.field != expected.field))
+            return false;
+
+        p = close + 1;
+        while (isspace(*p) || *p == ',')
+            p++;
+    }
+
+    return true;
+}
+
 void MediaController::showInfo()
 {
     const struct media_device_info *info = media_get_info(m_mediaDevice);
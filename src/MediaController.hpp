@@ -10,6 +10,7 @@
 
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <xen/be/Log.hpp>
 #include "Config.hpp"
@@ -17,22 +18,46 @@
 class MediaController final
 {
 public:
-    MediaController(std::string devName, ConfigPtr config);
+    MediaController(std::string devName, std::string videoId,
+                    ConfigPtr config);
     ~MediaController();
 
     MediaController(MediaController&&) = delete;
     MediaController(const MediaController&) = delete;
     void operator = (const MediaController&) = delete;
 
+    /* Check if the configured pipeline is the one which is set up. */
+    bool pipelineMatches(ConfigPtr config);
+    /* Set up the pipeline as configured, only applying what differs. */
+    void reconfigure(ConfigPtr config);
+
 private:
     XenBackend::Log mLog;
     const std::string mDevPath;
+    const std::string mMediaId;
+    const std::string mVideoId;
     ConfigPtr mConfig;
 
+    /* Pipeline which is set up now. */
+    Config::PipelineConfig mPipeline;
+
     void init();
+    struct media_device *mediaDeviceOpen();
     void release();
     void showInfo();
 
+    struct LinkSetup {
+        struct media_link *link;
+        uint32_t flags;
+    };
+
+    void setup(const Config::PipelineConfig& config);
+    int setupLinks(const std::vector<std::string>& links,
+                   const std::vector<std::string>& previousLinks);
+    void parseLinks(const std::string& links, std::vector<LinkSetup>& setups);
+    int disableLink(const struct media_link *link);
+    bool formatsMatch(const std::string& formats);
+
     struct media_device *m_mediaDevice = nullptr;
 };
 
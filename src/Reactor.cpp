@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <xen/be/Exception.hpp>
+
+#include "Reactor.hpp"
+
+using XenBackend::Exception;
+
+Reactor::Reactor(int numThreads, const ThreadConfig& threadConfig):
+    mLog("Reactor"),
+    mEpollFd(-1),
+    mEventFd(-1),
+    mThreadConfig(threadConfig)
+{
+    try {
+        init(numThreads);
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+Reactor::~Reactor()
+{
+    release();
+}
+
+void Reactor::init(int numThreads)
+{
+    LOG(mLog, DEBUG) << "Create reactor, threads: " << numThreads;
+
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (mEpollFd < 0)
+        throw Exception("Failed to create epoll", errno);
+
+    mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (mEventFd < 0)
+        throw Exception("Failed to create eventfd", errno);
+
+    /* Level triggered and never read: wakes up all the threads on stop. */
+    epoll_event event {0};
+
+    event.events = EPOLLIN;
+    event.data.fd = mEventFd;
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mEventFd, &event) < 0)
+        throw Exception("Failed to add eventfd to epoll", errno);
+
+    for (int i = 0; i < numThreads; i++)
+        mThreads.push_back(std::thread(&Reactor::eventThread, this, i));
+}
+
+void Reactor::release()
+{
+    if (mEventFd >= 0) {
+        uint64_t value = 1;
+
+        if (write(mEventFd, &value, sizeof(value)) < 0)
+            LOG(mLog, ERROR) << "Failed to stop reactor, errno " << errno;
+    }
+
+    for (auto& thread : mThreads)
+        if (thread.joinable())
+            thread.join();
+
+    mThreads.clear();
+
+    if (mEventFd >= 0)
+        ::close(mEventFd);
+
+    if (mEpollFd >= 0)
+        ::close(mEpollFd);
+
+    mEventFd = -1;
+    mEpollFd = -1;
+}
+
+void Reactor::add(int fd, uint32_t events, Handler handler)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto entry = std::make_shared<Entry>();
+
+    entry->events = events;
+    entry->handler = handler;
+    entry->running = false;
+    entry->armPending = false;
+
+    epoll_event event {0};
+
+    event.events = events | EPOLLONESHOT;
+    event.data.fd = fd;
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+        throw Exception("Failed to add fd to epoll", errno);
+
+    mEntries[fd] = entry;
+}
+
+/*
+ * Must be called with mLock held.
+ */
+void Reactor::rearm(int fd, const Entry& entry)
+{
+    epoll_event event {0};
+
+    event.events = entry.events | EPOLLONESHOT;
+    event.data.fd = fd;
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, fd, &event) < 0)
+        LOG(mLog, ERROR) << "Failed to arm fd " << fd << ", errno " << errno;
+}
+
+void Reactor::arm(int fd)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mEntries.find(fd);
+
+    if (it == mEntries.end())
+        return;
+
+    /* It is armed when the handler returns. */
+    if (it->second->running)
+        it->second->armPending = true;
+    else
+        rearm(fd, *it->second);
+}
+
+void Reactor::remove(int fd)
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    auto it = mEntries.find(fd);
+
+    if (it == mEntries.end())
+        return;
+
+    auto entry = it->second;
+
+    mEntries.erase(it);
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr) < 0)
+        LOG(mLog, ERROR) << "Failed to remove fd " << fd << ", errno " << errno;
+
+    mCondition.wait(lock, [&entry] { return !entry->running; });
+}
+
+void Reactor::eventThread(size_t id)
+{
+    auto threadConfig = mThreadConfig;
+
+    if (!threadConfig.name.empty())
+        threadConfig.name += "-" + std::to_string(id);
+
+    threadConfig.apply("cam-reactor-" + std::to_string(id));
+
+    while (true) {
+        epoll_event event;
+
+        int ret = epoll_wait(mEpollFd, &event, 1, -1);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            LOG(mLog, ERROR) << "Failed to wait for events, errno " << errno;
+            break;
+        }
+
+        if (!ret)
+            continue;
+
+        int fd = event.data.fd;
+
+        if (fd == mEventFd)
+            break;
+
+        std::unique_lock<std::mutex> lock(mLock);
+
+        auto it = mEntries.find(fd);
+
+        /* Removed meanwhile. */
+        if (it == mEntries.end())
+            continue;
+
+        auto entry = it->second;
+
+        entry->running = true;
+        entry->armPending = false;
+
+        lock.unlock();
+
+        bool armed = false;
+
+        try {
+            armed = entry->handler();
+        } catch(const std::exception& e) {
+            LOG(mLog, ERROR) << e.what();
+        }
+
+        lock.lock();
+
+        entry->running = false;
+
+        if ((armed || entry->armPending) && mEntries.count(fd))
+            rearm(fd, *entry);
+
+        entry->armPending = false;
+
+        mCondition.notify_all();
+    }
+}
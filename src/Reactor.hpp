@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_REACTOR_HPP_
+#define SRC_REACTOR_HPP_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <xen/be/Log.hpp>
+
+#include "ThreadConfig.hpp"
+
+/*
+ * Waits for the events of many file descriptors, e.g. of all the cameras,
+ * with a fixed number of threads sharing a single epoll set.
+ * A descriptor is disarmed while its handler runs, so the handler of the
+ * same descriptor is never run by two threads at once. The handler returns
+ * true to be armed again, otherwise the descriptor stays registered, but
+ * disarmed until arm() is called.
+ */
+class Reactor
+{
+public:
+    typedef std::function<bool()> Handler;
+
+    Reactor(int numThreads, const ThreadConfig& threadConfig);
+    ~Reactor();
+
+    void add(int fd, uint32_t events, Handler handler);
+    void arm(int fd);
+    /*
+     * Waits for the handler to complete if it is running now, so must not
+     * be called from the handler of the same descriptor.
+     */
+    void remove(int fd);
+
+private:
+    struct Entry {
+        uint32_t events;
+        Handler handler;
+        bool running;
+        bool armPending;
+    };
+
+    XenBackend::Log mLog;
+    std::mutex mLock;
+    std::condition_variable mCondition;
+
+    int mEpollFd;
+    int mEventFd;
+
+    std::unordered_map<int, std::shared_ptr<Entry>> mEntries;
+    std::vector<std::thread> mThreads;
+    ThreadConfig mThreadConfig;
+
+    void init(int numThreads);
+    void release();
+
+    void rearm(int fd, const Entry& entry);
+    void eventThread(size_t id);
+};
+
+typedef std::shared_ptr<Reactor> ReactorPtr;
+
+#endif /* SRC_REACTOR_HPP_ */
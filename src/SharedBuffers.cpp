@@ -0,0 +1,133 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <xen/be/Exception.hpp>
+#include <xen/be/XenGnttab.hpp>
+
+#include "SharedBuffers.hpp"
+
+using XenBackend::Exception;
+
+static const size_t cGrefsPerDirectory =
+    (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
+        sizeof(uint32_t);
+
+SharedBuffers::SharedBuffers(domid_t domId,
+                             const std::vector<DmaBuffer>& buffers) :
+    mLog("SharedBuffers"),
+    mDomId(domId),
+    mGnttab(nullptr),
+    mGntshr(nullptr)
+{
+    try {
+        init(buffers);
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+SharedBuffers::~SharedBuffers()
+{
+    release();
+}
+
+void SharedBuffers::init(const std::vector<DmaBuffer>& buffers)
+{
+    mGnttab = xengnttab_open(nullptr, 0);
+
+    if (!mGnttab)
+        throw Exception("Can't open grant table device", errno);
+
+    mGntshr = xengntshr_open(nullptr, 0);
+
+    if (!mGntshr)
+        throw Exception("Can't open grant share device", errno);
+
+    for (auto const& buffer : buffers)
+        share(buffer);
+
+    LOG(mLog, DEBUG) << "Shared " << buffers.size() << " buffers, domId " <<
+        std::to_string(mDomId);
+}
+
+void SharedBuffers::release()
+{
+    for (auto const& directory : mDirectoryPages)
+        xengntshr_unshare(mGntshr, directory.address, directory.count);
+
+    for (auto fd : mGrantedFds) {
+        if (xengnttab_dmabuf_imp_release(mGnttab, fd) < 0)
+            LOG(mLog, ERROR) << "Can't end access to shared buffer, domId " <<
+                std::to_string(mDomId) << ", errno " << errno;
+
+        ::close(fd);
+    }
+
+    if (mGntshr)
+        xengntshr_close(mGntshr);
+
+    if (mGnttab)
+        xengnttab_close(mGnttab);
+}
+
+/*
+ * Grant the pages of the buffer and describe them with the page directory,
+ * the same way a frontend does for BUF_CREATE.
+ */
+void SharedBuffers::share(const DmaBuffer& buffer)
+{
+    size_t numRefs = (buffer.size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    std::vector<grant_ref_t> refs(numRefs);
+
+    /* Own descriptor, so the access can be ended whatever the camera does. */
+    int fd = dup(buffer.fd);
+
+    if (fd < 0)
+        throw Exception("Can't duplicate shared buffer descriptor", errno);
+
+    if (xengnttab_dmabuf_imp_to_refs(mGnttab, mDomId, fd, numRefs,
+                                     refs.data()) < 0) {
+        ::close(fd);
+
+        throw Exception("Can't grant shared buffer, domId " +
+                        std::to_string(mDomId), errno);
+    }
+
+    mGrantedFds.push_back(fd);
+
+    size_t numDirs = (numRefs + cGrefsPerDirectory - 1) / cGrefsPerDirectory;
+    std::vector<grant_ref_t> dirRefs(numDirs);
+
+    auto address = static_cast<uint8_t *>(
+        xengntshr_share_pages(mGntshr, mDomId, numDirs, dirRefs.data(), 0));
+
+    if (!address)
+        throw Exception("Can't share page directory, domId " +
+                        std::to_string(mDomId), errno);
+
+    mDirectoryPages.push_back({ address, numDirs });
+
+    for (size_t i = 0; i < numDirs; i++) {
+        auto directory = reinterpret_cast<xencamera_page_directory *>(
+            address + i * XC_PAGE_SIZE);
+        size_t first = i * cGrefsPerDirectory;
+        size_t count = std::min(cGrefsPerDirectory, numRefs - first);
+
+        directory->gref_dir_next_page = i + 1 < numDirs ? dirRefs[i + 1] : 0;
+
+        std::copy(refs.begin() + first, refs.begin() + first + count,
+                  directory->gref);
+    }
+
+    mDirectories.push_back(dirRefs[0]);
+}
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_SHAREDBUFFERS_HPP_
+#define SRC_SHAREDBUFFERS_HPP_
+
+#include <memory>
+#include <vector>
+
+#include <xen/be/Log.hpp>
+
+#include <xen/io/cameraif.h>
+
+extern "C" {
+#include <xengnttab.h>
+}
+
+/*
+ * Shared buffers extension of the camera protocol, an alternative to
+ * BUF_CREATE for frontends which only read the frames:
+ * - the frontend writes "1" to XENCAMERA_FIELD_SHARED_BUFFERS of its
+ *   XenStore path before it initializes, the backend acknowledges with
+ *   "1" in the same field of its own path before it connects;
+ * - on STREAM_START the backend grants the camera buffers to the frontend
+ *   and writes the first page directory of every buffer, in buffer index
+ *   order, to XENCAMERA_FIELD_SHARED_BUFFERS_DIR of its path, separated by
+ *   XENCAMERA_LIST_SEPARATOR. The directories are granted read-only and
+ *   have the layout of those of BUF_CREATE;
+ * - FRAME_AVAIL carries the index of the camera buffer, which the frontend
+ *   holds until it sends BUF_QUEUE with the same index. The camera does not
+ *   fill a buffer until all the frontends have queued it back;
+ * - STREAM_STOP releases all the buffers held and ends the access;
+ * - STREAM_START fails with EBUSY while another frontend streams from the
+ *   camera or holds the access to its current buffers.
+ */
+#define XENCAMERA_FIELD_SHARED_BUFFERS      "shared-buffers"
+#define XENCAMERA_FIELD_SHARED_BUFFERS_DIR  "shared-buffers-dir"
+
+/* Exported camera buffer. */
+struct DmaBuffer {
+    int fd;
+    size_t size;
+};
+
+/***************************************************************************//**
+ * Camera buffers granted to a frontend with their page directories.
+ * The kernel only grants dma-bufs writable: the camera handler only shares
+ * the buffers with a frontend which is alone on the camera, so it can't
+ * alter the frames of the others.
+ ******************************************************************************/
+class SharedBuffers
+{
+public:
+    SharedBuffers(domid_t domId, const std::vector<DmaBuffer>& buffers);
+    ~SharedBuffers();
+
+    SharedBuffers(const SharedBuffers&) = delete;
+    void operator = (const SharedBuffers&) = delete;
+
+    /* First page directory of every buffer. */
+    const std::vector<grant_ref_t>& getDirectories() const {
+        return mDirectories;
+    }
+
+private:
+    XenBackend::Log mLog;
+
+    domid_t mDomId;
+
+    xengnttab_handle *mGnttab;
+    xengntshr_handle *mGntshr;
+
+    struct Directory {
+        void *address;
+        size_t count;
+    };
+
+    std::vector<int> mGrantedFds;
+    std::vector<Directory> mDirectoryPages;
+    std::vector<grant_ref_t> mDirectories;
+
+    void init(const std::vector<DmaBuffer>& buffers);
+    void release();
+
+    void share(const DmaBuffer& buffer);
+};
+
+typedef std::unique_ptr<SharedBuffers> SharedBuffersPtr;
+
+#endif /* SRC_SHAREDBUFFERS_HPP_ */
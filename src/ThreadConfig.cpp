@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <pthread.h>
+
+#include <sstream>
+
+#include <xen/be/Log.hpp>
+
+#include "ThreadConfig.hpp"
+
+static const char *policyToString(int policy)
+{
+    switch (policy) {
+    case SCHED_FIFO:
+        return "fifo";
+    case SCHED_RR:
+        return "rr";
+    default:
+        return "other";
+    }
+}
+
+void ThreadConfig::apply(const std::string& defaultName) const
+{
+    XenBackend::Log log("ThreadConfig");
+    pthread_t thread = pthread_self();
+    std::string threadName = (name.empty() ? defaultName : name).substr(0, 15);
+    int ret;
+
+    ret = pthread_setname_np(thread, threadName.c_str());
+
+    if (ret)
+        LOG(log, WARNING) << "Failed to set name of thread " << threadName <<
+            ", error " << ret;
+
+    if (!cpus.empty()) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+
+        for (auto cpu : cpus)
+            CPU_SET(cpu, &set);
+
+        ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+
+        if (ret)
+            LOG(log, WARNING) << "Failed to set CPU affinity of thread " <<
+                threadName << ", error " << ret;
+    }
+
+    if (policy != SCHED_OTHER) {
+        sched_param param {0};
+
+        param.sched_priority = priority;
+
+        ret = pthread_setschedparam(thread, policy, &param);
+
+        if (ret)
+            LOG(log, WARNING) << "Failed to set scheduling of thread " <<
+                threadName << ", error " << ret;
+    }
+
+    /* Log what the thread has actually got. */
+    cpu_set_t set;
+    std::stringstream cpuList;
+
+    CPU_ZERO(&set);
+
+    if (!pthread_getaffinity_np(thread, sizeof(set), &set))
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &set))
+                cpuList << (cpuList.tellp() ? "," : "") << cpu;
+
+    int effectivePolicy = SCHED_OTHER;
+    sched_param param {0};
+
+    pthread_getschedparam(thread, &effectivePolicy, &param);
+
+    LOG(log, INFO) << "Thread " << threadName << ": policy " <<
+        policyToString(effectivePolicy) << ", priority " <<
+        param.sched_priority << ", cpus " << cpuList.str() <<
+        ", running on cpu " << sched_getcpu();
+}
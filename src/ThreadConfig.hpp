@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_THREADCONFIG_HPP_
+#define SRC_THREADCONFIG_HPP_
+
+#include <sched.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Placement and scheduling of a thread:
+ * cpus - CPUs the thread runs on, all if empty.
+ * policy - SCHED_OTHER, SCHED_FIFO or SCHED_RR.
+ * priority - static priority for SCHED_FIFO and SCHED_RR.
+ * name - name of the thread, truncated to 15 characters.
+ */
+struct ThreadConfig {
+    std::vector<int> cpus;
+    int policy = SCHED_OTHER;
+    int priority = 0;
+    std::string name;
+
+    /*
+     * Apply to the calling thread and log its effective placement.
+     * Failures are logged, the thread keeps running as it is.
+     */
+    void apply(const std::string& defaultName) const;
+};
+
+#endif /* SRC_THREADCONFIG_HPP_ */
@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+
+#include "TokenBucket.hpp"
+
+TokenBucket::TokenBucket(double rate, double burst):
+    mRate(rate),
+    mBurst(burst > 0 ? burst : rate),
+    mTokens(mBurst),
+    mLastTime(std::chrono::steady_clock::now())
+{
+}
+
+bool TokenBucket::check(double tokens, std::chrono::steady_clock::time_point now)
+{
+    if (mRate <= 0)
+        return true;
+
+    std::chrono::duration<double> elapsed = now - mLastTime;
+
+    mLastTime = now;
+    mTokens = std::min(mBurst, mTokens + elapsed.count() * mRate);
+
+    return mTokens >= std::min(tokens, mBurst);
+}
+
+void TokenBucket::take(double tokens)
+{
+    if (mRate <= 0)
+        return;
+
+    mTokens -= tokens;
+}
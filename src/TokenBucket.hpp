@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef SRC_TOKENBUCKET_HPP_
+#define SRC_TOKENBUCKET_HPP_
+
+#include <chrono>
+
+/*
+ * Rate limiter: tokens are added at the given rate per second, up to
+ * burst of them, a second worth by default. Items bigger than the burst,
+ * e.g. frames bigger than the byte rate, are taken from the full bucket,
+ * which goes into debt then, so they still pass at the average rate.
+ * Zero rate means no limit.
+ * Checking is separate from taking, so several buckets can be checked
+ * before taking from any of them, and the tokens are only taken for the
+ * items which are actually passed on.
+ */
+class TokenBucket
+{
+public:
+    explicit TokenBucket(double rate = 0, double burst = 0);
+
+    bool check(double tokens, std::chrono::steady_clock::time_point now);
+    void take(double tokens);
+
+private:
+    double mRate;
+    double mBurst;
+    double mTokens;
+    std::chrono::steady_clock::time_point mLastTime;
+};
+
+#endif /* SRC_TOKENBUCKET_HPP_ */
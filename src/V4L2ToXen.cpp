@@ -334,6 +334,18 @@ const std::string V4L2ToXen::ctrlGetNameXen(int xen)
                                 std::to_string(xen), EINVAL);
 }
 
+const std::string V4L2ToXen::ctrlGetNameV4L2(int v4l2)
+{
+    int i;
+
+    for (i = 0; XEN_CTRL[i].xen != -1; i++)
+        if (XEN_CTRL[i].v4l2 == v4l2)
+            return XEN_CTRL[i].name;
+
+    throw XenBackend::Exception("Unsupported V4L2 control type " +
+                                std::to_string(v4l2), EINVAL);
+}
+
 int V4L2ToXen::ctrlGetTypeXen(const std::string& name)
 {
     int i;
@@ -18,6 +18,7 @@ public:
     static int ctrlToV4L2(int xen);
 
     static const std::string ctrlGetNameXen(int xen);
+    static const std::string ctrlGetNameV4L2(int v4l2);
     static int ctrlGetTypeXen(const std::string& name);
 
     static int ctrlFlagsToXen(int v4l2);
@@ -29,6 +29,7 @@ using XenBackend::Utils;
 
 string gLogFileName;
 string gCfgFileName;
+string gCacheDirName;
 
 int gRetStatus = EXIT_SUCCESS;
 
@@ -60,17 +61,41 @@ void registerSignals()
     sigaction(SIGSEGV, &act, nullptr);
 }
 
-void waitSignals()
+void getWaitedSignals(sigset_t *set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGHUP);
+}
+
+/*
+ * Signals are blocked before any thread is created, so all the threads
+ * inherit the mask and the signals are only received by waitSignals.
+ */
+void blockSignals()
 {
     sigset_t set;
-    int signal;
 
-    sigemptyset(&set);
-    sigaddset(&set, SIGINT);
-    sigaddset(&set, SIGTERM);
+    getWaitedSignals(&set);
     sigprocmask(SIG_BLOCK, &set, nullptr);
+}
+
+void waitSignals(Backend& backend)
+{
+    sigset_t set;
+    int signal;
+
+    getWaitedSignals(&set);
 
-    sigwait(&set,&signal);
+    while (true) {
+        sigwait(&set,&signal);
+
+        if (signal != SIGHUP)
+            break;
+
+        backend.reloadConfig();
+    }
 
     if (signal == SIGTERM)
         gRetStatus = EXIT_FAILURE;
@@ -80,7 +105,7 @@ bool commandLineOptions(int argc, char *argv[])
 {
     int opt = -1;
 
-    while((opt = getopt(argc, argv, "c:v:l:fh?")) != -1) {
+    while((opt = getopt(argc, argv, "c:d:v:l:fh?")) != -1) {
         switch(opt) {
         case 'v':
             if (!Log::setLogMask(string(optarg)))
@@ -99,6 +124,10 @@ bool commandLineOptions(int argc, char *argv[])
             gCfgFileName = optarg;
             break;
 
+        case 'd':
+            gCacheDirName = optarg;
+            break;
+
         default:
             return false;
         }
@@ -112,6 +141,7 @@ int main(int argc, char *argv[])
 {
     try {
         registerSignals();
+        blockSignals();
 
         if (commandLineOptions(argc, argv)) {
             LOG("Main", INFO) << "backend version:  " <<
@@ -130,14 +160,15 @@ int main(int argc, char *argv[])
 
             backend.start();
 
-            waitSignals();
+            waitSignals(backend);
 
             logFile.close();
         } else {
             cout << "Usage: " << argv[0]
-                << " [-c <file>] [-l <file>] [-v <level>]"
+                << " [-c <file>] [-d <dir>] [-l <file>] [-v <level>]"
                 << endl;
             cout << "\t-c -- config file" << endl;
+            cout << "\t-d -- camera capability cache directory" << endl;
             cout << "\t-l -- log file" << endl;
             cout << "\t-v -- verbose level in format: "
                 << "<module>:<level>;<module:<level>" << endl;
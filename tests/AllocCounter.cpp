@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "AllocCounter.hpp"
+
+static std::atomic<bool> gCounting(false);
+static std::atomic<size_t> gAllocations(0);
+
+void *operator new(size_t size)
+{
+    if (gCounting)
+        gAllocations++;
+
+    void *ptr = malloc(size ? size : 1);
+
+    if (!ptr)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+namespace AllocCounter {
+
+void start()
+{
+    gAllocations = 0;
+    gCounting = true;
+}
+
+size_t stop()
+{
+    gCounting = false;
+
+    return gAllocations;
+}
+
+}
@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef TESTS_ALLOCCOUNTER_HPP_
+#define TESTS_ALLOCCOUNTER_HPP_
+
+#include <cstddef>
+
+/*
+ * Counts the heap allocations made through operator new, by any thread,
+ * between start and stop. Linking it in replaces the global operator new.
+ */
+namespace AllocCounter {
+
+void start();
+/* Returns the number of allocations since start. */
+size_t stop();
+
+}
+
+#endif /* TESTS_ALLOCCOUNTER_HPP_ */
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef TESTS_CHECK_HPP_
+#define TESTS_CHECK_HPP_
+
+#include <cstdlib>
+#include <iostream>
+
+/* Fails the test right away, with the location of the failed check. */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << \
+                " failed" << std::endl; \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#endif /* TESTS_CHECK_HPP_ */
@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+/*
+ * Heap allocations on the steady-state frame path: a camera handler, run
+ * without hardware, delivers frames to the command handlers of stand-in
+ * frontends. Those copy the frames to the frontend buffers, mapped and with
+ * grant copy, under quotas, with and without the executor, and send the
+ * FRAME_AVAIL events to the event rings. The frontends take the events off
+ * the rings and send BUF_DEQUEUE and BUF_QUEUE back for every frame, as
+ * a frontend streaming does. Fails if anything is allocated once the first
+ * frames have gone through.
+ * The camera itself can't be run without a device, so the frames enter the
+ * camera handler right after the camera has dequeued them.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "AllocCounter.hpp"
+#include "CameraHandler.hpp"
+#include "Check.hpp"
+#include "CommandHandler.hpp"
+#include "LocalGrantMapper.hpp"
+
+/* No capability cache. */
+std::string gCacheDirName;
+
+/* Gets to the frame path of the handlers, which have no camera to run it. */
+class FrameAllocTest
+{
+public:
+    static bool deliver(CameraHandler& handler, uint8_t *data, size_t size)
+    {
+        return handler.frameDeliver(-1, data, size);
+    }
+
+    /* BUF_CREATE takes the buffer size from the camera. */
+    static void bufCreate(CommandHandler& handler, FrontendBufferPtr buffer)
+    {
+        std::lock_guard<std::mutex> lock(handler.mLock);
+
+        handler.mBuffers[buffer->getIndex()] = std::move(buffer);
+    }
+};
+
+static const char *cConfigName = "FrameAllocTest.cfg";
+static const size_t cFrameSize = 1280 * 720 * 2;
+static const int cNumBuffers = 2;
+static const int cWarmUpFrames = 10;
+static const int cFrames = 200;
+
+struct Frontend {
+    domid_t domId;
+    bool grantCopy;
+    std::shared_ptr<LocalGrantMapper> mapper;
+    xencamera_event_page *page;
+    std::unique_ptr<CommandHandler> commandHandler;
+    size_t frames;
+};
+
+static void command(Frontend& frontend, uint8_t operation, uint8_t index)
+{
+    xencamera_req req {0};
+    xencamera_resp resp {0};
+
+    req.operation = operation;
+    req.req.index.index = index;
+
+    if (operation == XENCAMERA_OP_BUF_REQUEST)
+        req.req.buf_request.num_bufs = index;
+
+    CHECK(frontend.commandHandler->processCommand(req, resp) == 0);
+}
+
+/* Takes the frame events off the ring and gets the buffers back. */
+static void consume(Frontend& frontend)
+{
+    auto page = frontend.page;
+    auto events = reinterpret_cast<xencamera_evt *>(
+        reinterpret_cast<uint8_t *>(page) + XENCAMERA_IN_RING_OFFS);
+    uint32_t numEvents = XENCAMERA_IN_RING_SIZE / sizeof(xencamera_evt);
+
+    for (uint32_t cons = page->in_cons; cons != page->in_prod; cons++) {
+        auto& event = events[cons % numEvents];
+
+        CHECK(event.type == XENCAMERA_EVT_FRAME_AVAIL);
+        CHECK(event.evt.frame_avail.used_sz == cFrameSize);
+
+        command(frontend, XENCAMERA_OP_BUF_DEQUEUE,
+                event.evt.frame_avail.index);
+        command(frontend, XENCAMERA_OP_BUF_QUEUE,
+                event.evt.frame_avail.index);
+
+        frontend.frames++;
+    }
+
+    page->in_cons = page->in_prod;
+}
+
+static void run(const char *name, ExecutorPtr executor)
+{
+    ConfigPtr config(new Config(cConfigName));
+    CameraHandlerPtr handler(new CameraHandler("video-alloc-test", config,
+                                               nullptr, executor));
+
+    Frontend frontends[] = {
+        { 1, false }, { 2, true }, { 3, false },
+    };
+
+    for (auto& frontend : frontends) {
+        /* Room for the buffers, their directories and the event ring. */
+        frontend.mapper = std::make_shared<LocalGrantMapper>(
+            4 * cNumBuffers * (cFrameSize / XC_PAGE_SIZE + 16));
+
+        grant_ref_t ringRef = frontend.mapper->allocPage();
+
+        frontend.page = reinterpret_cast<xencamera_event_page *>(
+            frontend.mapper->page(ringRef));
+
+        EventRingBufferPtr ring(new EventRingBuffer(frontend.mapper, ringRef,
+                                                    XENCAMERA_IN_RING_OFFS,
+                                                    XENCAMERA_IN_RING_SIZE));
+
+        frontend.commandHandler.reset(new CommandHandler(frontend.domId,
+            frontend.mapper, ring, "", handler, config->getBackendConfig()));
+        frontend.frames = 0;
+
+        command(frontend, XENCAMERA_OP_BUF_REQUEST, cNumBuffers);
+
+        for (int i = 0; i < cNumBuffers; i++) {
+            std::vector<grant_ref_t> refs;
+            xencamera_req req {0};
+            FrontendBufferPtr buffer;
+
+            req.req.buf_create.index = i;
+            req.req.buf_create.gref_directory =
+                frontend.mapper->allocBuffer(cFrameSize, refs);
+
+            if (frontend.grantCopy)
+                buffer.reset(new CopyFrontendBuffer(frontend.mapper,
+                    frontend.domId, cFrameSize, req));
+            else
+                buffer.reset(new MappedFrontendBuffer(frontend.mapper,
+                    frontend.domId, cFrameSize, req));
+
+            FrameAllocTest::bufCreate(*frontend.commandHandler,
+                                      std::move(buffer));
+
+            command(frontend, XENCAMERA_OP_BUF_QUEUE, i);
+        }
+
+        command(frontend, XENCAMERA_OP_STREAM_START, 0);
+    }
+
+    std::vector<uint8_t> frame(cFrameSize, 0x5a);
+
+    auto frameRun = [&](int numFrames) {
+        for (int i = 0; i < numFrames; i++) {
+            FrameAllocTest::deliver(*handler, frame.data(), frame.size());
+
+            for (auto& frontend : frontends)
+                consume(frontend);
+        }
+    };
+
+    frameRun(cWarmUpFrames);
+
+    AllocCounter::start();
+
+    frameRun(cFrames);
+
+    size_t allocations = AllocCounter::stop();
+
+    std::cout << name << ": " << allocations << " allocations in " <<
+        cFrames << " frames, frontends got " << frontends[0].frames <<
+        ", " << frontends[1].frames << ", " << frontends[2].frames <<
+        std::endl;
+
+    CHECK(allocations == 0);
+
+    /* The throttled frontend only gets some of the frames. */
+    CHECK(frontends[0].frames == cWarmUpFrames + cFrames);
+    CHECK(frontends[1].frames == cWarmUpFrames + cFrames);
+    CHECK(frontends[2].frames < cWarmUpFrames + cFrames);
+
+    for (auto& frontend : frontends)
+        command(frontend, XENCAMERA_OP_STREAM_STOP, 0);
+}
+
+int main()
+{
+    std::ofstream(cConfigName) <<
+        "domains = ( { id = 3; max_fps = 10; } );" << std::endl;
+
+    run("inline", nullptr);
+    run("executor", std::make_shared<Executor>(2, ThreadConfig()));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+/*
+ * Shared buffers bookkeeping against stand-in frontends: a camera with
+ * a few buffers fills only those nobody holds, the frontends get the buffer
+ * index with every frame and release it when they have read it, some of
+ * them late or never.
+ */
+
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#include "Check.hpp"
+#include "FrameHolds.hpp"
+
+static const int cNumBuffers = 4;
+/* As the camera handler does. */
+static const size_t cMaxHolds = 1;
+static const size_t cMaxHeld = cNumBuffers - 1;
+
+/* Reads every frame it gets for the given number of frames. */
+struct Frontend {
+    domid_t domId;
+    size_t readFrames;
+    std::deque<std::pair<int, size_t>> reading;
+    size_t frames;
+    size_t dropped;
+};
+
+/* Stand-in camera: the buffers are filled in turn, skipping held ones. */
+class Camera
+{
+public:
+    Camera(FrameHolds& holds) : mHolds(holds), mNext(0), mStalls(0) {}
+
+    /* Returns the index of the filled buffer, -1 if all are held. */
+    int capture()
+    {
+        for (int i = 0; i < cNumBuffers; i++) {
+            int index = (mNext + i) % cNumBuffers;
+
+            if (!mHolds.getHolds(index)) {
+                mNext = index + 1;
+
+                return index;
+            }
+        }
+
+        mStalls++;
+
+        return -1;
+    }
+
+    size_t getStalls() const { return mStalls; }
+
+private:
+    FrameHolds& mHolds;
+    int mNext;
+    size_t mStalls;
+};
+
+static void testHolds()
+{
+    FrameHolds holds(cMaxHolds, cMaxHeld);
+
+    CHECK(holds.hold(1, 0));
+    CHECK(!holds.hold(1, 0));
+    CHECK(holds.hold(2, 0));
+    CHECK(holds.getHolds(0) == 2);
+
+    CHECK(!holds.hold(1, 1));
+
+    CHECK(holds.release(1, 0));
+    CHECK(!holds.release(1, 0));
+    CHECK(!holds.release(3, 0));
+    CHECK(holds.getHolds(0) == 1);
+
+    /* The camera keeps a buffer to fill. */
+    CHECK(holds.hold(1, 1));
+    CHECK(holds.hold(3, 2));
+    CHECK(!holds.hold(4, 3));
+    CHECK(holds.hold(4, 2));
+    CHECK(holds.getHeld() == cMaxHeld);
+
+    auto released = holds.releaseAll(1);
+
+    CHECK(released.size() == 1 && released[0] == 1);
+    CHECK(holds.releaseAll(1).empty());
+    CHECK(holds.getHolds(1) == 0);
+    CHECK(holds.hold(5, 3));
+
+    holds.clear();
+
+    CHECK(holds.getHolds(0) == 0 && holds.getHeld() == 0);
+}
+
+static void testFanOut()
+{
+    FrameHolds holds(cMaxHolds, cMaxHeld);
+    Camera camera(holds);
+
+    std::vector<Frontend> frontends = {
+        { 1, 1 },   /* reads a frame before the next one comes */
+        { 2, 3 },   /* takes three frame intervals */
+        { 3, 0 },   /* never releases, until it goes away */
+    };
+
+    const size_t cFrames = 1000;
+
+    for (size_t frame = 0; frame < cFrames; frame++) {
+        /* The frontends release what they have read by now. */
+        for (auto& frontend : frontends) {
+            while (!frontend.reading.empty() &&
+                   frontend.reading.front().second <= frame) {
+                CHECK(holds.release(frontend.domId,
+                                    frontend.reading.front().first));
+
+                frontend.reading.pop_front();
+            }
+        }
+
+        if (frame == cFrames / 2)
+            CHECK(holds.releaseAll(3).size() == cMaxHolds);
+
+        int index = camera.capture();
+
+        if (index < 0)
+            continue;
+
+        for (auto& frontend : frontends) {
+            if (frontend.domId == 3 && frame >= cFrames / 2)
+                continue;
+
+            if (!holds.hold(frontend.domId, index)) {
+                frontend.dropped++;
+                continue;
+            }
+
+            frontend.frames++;
+
+            if (frontend.readFrames)
+                frontend.reading.emplace_back(index,
+                                              frame + frontend.readFrames);
+        }
+
+        /* Every frontend holding the buffer has got this very frame. */
+        CHECK(holds.getHolds(index) <= frontends.size());
+    }
+
+    /*
+     * The never releasing frontend pins a buffer and the slow one another,
+     * but the camera still has a buffer for every frame and the fast
+     * frontend gets them all. The slow one gets those it has time for.
+     */
+    CHECK(camera.getStalls() == 0);
+    CHECK(frontends[0].frames == cFrames && frontends[0].dropped == 0);
+    CHECK(frontends[1].frames >= cFrames / 3 && frontends[1].dropped > 0);
+    CHECK(frontends[2].frames == cMaxHolds);
+
+    std::cout << "fan-out: " << cFrames << " frames, frontends got " <<
+        frontends[0].frames << ", " << frontends[1].frames << ", " <<
+        frontends[2].frames << " without a copy" << std::endl;
+}
+
+int main()
+{
+    testHolds();
+    testFanOut();
+
+    return EXIT_SUCCESS;
+}
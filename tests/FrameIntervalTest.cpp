@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+/*
+ * Time per frame from the frame rate the camera reports: the rate is frames
+ * per second, so timeperframe comes in it upside down.
+ */
+
+#include <cstdlib>
+#include <iostream>
+
+#include "Camera.hpp"
+#include "Check.hpp"
+
+/* Takes timeperframe, as the driver sets it. */
+static long long interval(uint32_t numerator, uint32_t denominator)
+{
+    v4l2_fract frameRate { denominator, numerator };
+    auto interval = Camera::toFrameInterval(frameRate).count();
+
+    std::cout << "timeperframe " << numerator << "/" << denominator << ": " <<
+        interval << " us" << std::endl;
+
+    return interval;
+}
+
+int main()
+{
+    CHECK(interval(1, 30) == 33333);
+    CHECK(interval(1001, 30000) == 33366);
+    CHECK(interval(1, 60) == 16666);
+    CHECK(interval(1, 1) == 1000000);
+
+    /* Not known. */
+    CHECK(interval(0, 0) == 0);
+    CHECK(interval(1, 0) == 0);
+
+    return EXIT_SUCCESS;
+}
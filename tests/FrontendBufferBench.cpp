@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+/*
+ * Buffer creation and frame delivery against a stand-in grant mapper:
+ * checks that the grant references are read from the page directory and
+ * that frames land in the frontend pages, either mapped or written with
+ * grant copy, and reports the time taken by both.
+ * Usage: FrontendBufferBench [iterations]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <type_traits>
+
+#include "Check.hpp"
+#include "FrontendBuffer.hpp"
+#include "LocalGrantMapper.hpp"
+
+using namespace std::chrono;
+
+/* 4K RGB24 frame. */
+static const size_t cFrameSize = 3840 * 2160 * 3;
+static const uint32_t cOffset = 128;
+
+static const size_t cGrefsPerDirectory =
+    (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
+        sizeof(grant_ref_t);
+
+static xencamera_req createRequest(grant_ref_t directory)
+{
+    xencamera_req req {0};
+
+    req.req.buf_create.index = 0;
+    req.req.buf_create.plane_offset[0] = cOffset;
+    req.req.buf_create.gref_directory = directory;
+
+    return req;
+}
+
+static void checkFrame(LocalGrantMapper& frontend,
+                       const std::vector<grant_ref_t>& refs,
+                       const std::vector<uint8_t>& frame)
+{
+    for (size_t pos = 0; pos < frame.size(); pos += XC_PAGE_SIZE / 2) {
+        size_t offset = cOffset + pos;
+
+        CHECK(frontend.page(refs[offset / XC_PAGE_SIZE])
+              [offset % XC_PAGE_SIZE] == frame[pos]);
+    }
+}
+
+template<typename T>
+static void bench(const char *name, std::shared_ptr<LocalGrantMapper> frontend,
+                  int iterations)
+{
+    std::vector<grant_ref_t> refs;
+    auto directory = frontend->allocBuffer(cFrameSize + cOffset, refs);
+    auto req = createRequest(directory);
+
+    std::vector<uint8_t> frame(cFrameSize);
+
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = i * 7 + 1;
+
+    nanoseconds createTime(0), copyTime(0);
+
+    frontend->resetCounters();
+
+    for (int i = 0; i < iterations; i++) {
+        auto start = steady_clock::now();
+
+        T buffer(frontend, 1, cFrameSize, req);
+
+        auto created = steady_clock::now();
+
+        buffer.copyBuffer(frame.data(), frame.size());
+
+        copyTime += steady_clock::now() - created;
+        createTime += created - start;
+
+        CHECK(buffer.getRefs() == refs);
+    }
+
+    checkFrame(*frontend, refs, frame);
+
+    /* Only the directory pages and, if mapped, the buffer itself. */
+    size_t numDirs = (refs.size() + cGrefsPerDirectory - 1) /
+        cGrefsPerDirectory;
+    size_t numPages = numDirs +
+        (std::is_same<T, MappedFrontendBuffer>::value ? refs.size() : 0);
+
+    CHECK(frontend->getMappedPages() == numPages * iterations);
+
+    /* One grant copy call per frame, a segment per frontend page. */
+    if (std::is_same<T, CopyFrontendBuffer>::value)
+        CHECK(frontend->getCopyCalls() == static_cast<size_t>(iterations) &&
+              frontend->getCopySegments() == refs.size() * iterations);
+
+    std::cout << name << ": create " <<
+        duration_cast<microseconds>(createTime).count() / iterations <<
+        " us, " << frontend->getMapCalls() / iterations << " map calls, " <<
+        frontend->getMappedPages() / iterations << " pages mapped; copy " <<
+        duration_cast<microseconds>(copyTime).count() / iterations <<
+        " us per frame" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 10;
+
+    CHECK(iterations > 0);
+
+    /* Room for both the buffers and their directories. */
+    size_t numPages = 4 * (cFrameSize / XC_PAGE_SIZE + 16);
+    auto frontend = std::make_shared<LocalGrantMapper>(numPages);
+
+    bench<MappedFrontendBuffer>("map + memcpy", frontend, iterations);
+    bench<CopyFrontendBuffer>("grant copy", frontend, iterations);
+
+    return EXIT_SUCCESS;
+}
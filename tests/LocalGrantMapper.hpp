@@ -0,0 +1,189 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+#ifndef TESTS_LOCALGRANTMAPPER_HPP_
+#define TESTS_LOCALGRANTMAPPER_HPP_
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "GrantMapper.hpp"
+
+/*
+ * Stand-in for the grant table of a frontend: its memory is a shared memory
+ * file, page number n of which is granted as gref n. Mapping maps the pages
+ * of the file, so the backend writes to the very pages the frontend reads,
+ * as with real grants. Grant operations are counted.
+ */
+class LocalGrantMapper : public GrantMapper
+{
+public:
+    explicit LocalGrantMapper(size_t numPages) :
+        mNumPages(numPages),
+        mNextFree(1),
+        mMapCalls(0),
+        mMappedPages(0),
+        mCopyCalls(0),
+        mCopySegments(0)
+    {
+        mFd = memfd_create("frontend", 0);
+
+        if (mFd < 0 || ftruncate(mFd, numPages * XC_PAGE_SIZE) < 0)
+            throw std::runtime_error("Can't create frontend memory");
+
+        mMemory = static_cast<uint8_t *>(mmap(nullptr,
+            numPages * XC_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+            mFd, 0));
+
+        if (mMemory == MAP_FAILED)
+            throw std::runtime_error("Can't map frontend memory");
+    }
+
+    ~LocalGrantMapper()
+    {
+        munmap(mMemory, mNumPages * XC_PAGE_SIZE);
+        close(mFd);
+    }
+
+    void *map(const grant_ref_t *refs, size_t count, int prot) override
+    {
+        mMapCalls++;
+        mMappedPages += count;
+
+        auto address = static_cast<uint8_t *>(mmap(nullptr,
+            count * XC_PAGE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0));
+
+        if (address == MAP_FAILED)
+            throw std::runtime_error("Can't reserve mapping");
+
+        for (size_t i = 0; i < count; i++) {
+            if (!refs[i] || refs[i] >= mNumPages) {
+                munmap(address, count * XC_PAGE_SIZE);
+                throw std::runtime_error("Bad gref " + std::to_string(refs[i]));
+            }
+
+            if (mmap(address + i * XC_PAGE_SIZE, XC_PAGE_SIZE, prot,
+                     MAP_SHARED | MAP_FIXED, mFd,
+                     refs[i] * XC_PAGE_SIZE) == MAP_FAILED)
+                throw std::runtime_error("Can't map gref");
+        }
+
+        return address;
+    }
+
+    void unmap(void *address, size_t count) override
+    {
+        munmap(address, count * XC_PAGE_SIZE);
+    }
+
+    /* Only copies to the frontend pages are used by the backend. */
+    void copy(xengnttab_grant_copy_segment_t *segments, size_t count) override
+    {
+        mCopyCalls++;
+        mCopySegments += count;
+
+        for (size_t i = 0; i < count; i++) {
+            auto& segment = segments[i];
+            grant_ref_t ref = segment.dest.foreign.ref;
+
+            if (segment.flags != GNTCOPY_dest_gref || !ref ||
+                ref >= mNumPages ||
+                segment.dest.foreign.offset + segment.len > XC_PAGE_SIZE)
+                throw std::runtime_error("Bad copy segment, gref " +
+                                         std::to_string(ref));
+
+            memcpy(page(ref) + segment.dest.foreign.offset,
+                   segment.source.virt, segment.len);
+
+            segment.status = GNTST_okay;
+        }
+    }
+
+    /* Frontend side: grant pages, not contiguous, as a frontend would. */
+    grant_ref_t allocPage()
+    {
+        grant_ref_t ref = mNextFree;
+
+        mNextFree += 2;
+
+        if (mNextFree >= mNumPages)
+            throw std::runtime_error("Out of frontend memory");
+
+        return ref;
+    }
+
+    uint8_t *page(grant_ref_t ref) { return mMemory + ref * XC_PAGE_SIZE; }
+
+    /*
+     * Allocate a buffer with its page directory, as a frontend does on
+     * BUF_CREATE: returns the first directory page.
+     */
+    grant_ref_t allocBuffer(size_t size, std::vector<grant_ref_t>& refs)
+    {
+        const size_t grefsPerDir =
+            (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
+                sizeof(grant_ref_t);
+        size_t numRefs = (size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+
+        refs.clear();
+
+        for (size_t i = 0; i < numRefs; i++)
+            refs.push_back(allocPage());
+
+        grant_ref_t start = 0;
+        xencamera_page_directory *prev = nullptr;
+
+        for (size_t i = 0; i < numRefs; i += grefsPerDir) {
+            grant_ref_t ref = allocPage();
+            auto dir = reinterpret_cast<xencamera_page_directory *>(page(ref));
+            size_t num = std::min(grefsPerDir, numRefs - i);
+
+            dir->gref_dir_next_page = 0;
+            std::copy(refs.begin() + i, refs.begin() + i + num, dir->gref);
+
+            if (prev)
+                prev->gref_dir_next_page = ref;
+            else
+                start = ref;
+
+            prev = dir;
+        }
+
+        return start;
+    }
+
+    size_t getMapCalls() const { return mMapCalls; }
+    size_t getMappedPages() const { return mMappedPages; }
+    size_t getCopyCalls() const { return mCopyCalls; }
+    size_t getCopySegments() const { return mCopySegments; }
+
+    void resetCounters()
+    {
+        mMapCalls = mMappedPages = mCopyCalls = mCopySegments = 0;
+    }
+
+private:
+    size_t mNumPages;
+    grant_ref_t mNextFree;
+    int mFd;
+    uint8_t *mMemory;
+
+    size_t mMapCalls;
+    size_t mMappedPages;
+    size_t mCopyCalls;
+    size_t mCopySegments;
+};
+
+#endif /* TESTS_LOCALGRANTMAPPER_HPP_ */
@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2019 EPAM Systems Inc.
+ */
+
+/*
+ * Frame rate quota against a camera streaming at a fixed rate: the frames
+ * which pass the quota must come at the configured rate, whatever it is
+ * below the camera's.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include "Check.hpp"
+#include "TokenBucket.hpp"
+
+static const int cCameraFps = 30;
+static const int cSeconds = 10;
+/* As the camera handler sets the frame quota. */
+static const double cFrameBurst = 2;
+
+/* Returns the rate of the frames which pass the quota. */
+static double passedFps(double maxFps)
+{
+    auto start = std::chrono::steady_clock::now();
+    TokenBucket frames(maxFps, cFrameBurst);
+    int passed = 0;
+
+    for (int i = 0; i < cCameraFps * cSeconds; i++) {
+        /* Camera frames are never exactly on time. */
+        auto jitter = std::chrono::microseconds((i % 3 - 1) * 500);
+        auto now = start + std::chrono::microseconds(
+            1000000ll * (i + 1) / cCameraFps) + jitter;
+
+        if (frames.check(1, now)) {
+            frames.take(1);
+            passed++;
+        }
+    }
+
+    return static_cast<double>(passed) / cSeconds;
+}
+
+static void testFrameRate()
+{
+    for (int maxFps : { 1, 10, 15, 20, 25, 29, 30, 60 }) {
+        double fps = passedFps(maxFps);
+        double expected = std::min(maxFps, cCameraFps);
+
+        std::cout << "max fps " << maxFps << ": " << fps << " fps" <<
+            std::endl;
+
+        /* The bucket starts full, which lets a couple of frames more. */
+        CHECK(std::abs(fps - expected) <= 0.5);
+    }
+}
+
+/* Only taking costs tokens, e.g. not a frame throttled by another quota. */
+static void testCheck()
+{
+    TokenBucket frames(10, cFrameBurst);
+    auto now = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < 100; i++)
+        CHECK(frames.check(1, now));
+
+    frames.take(1);
+    CHECK(frames.check(1, now));
+
+    frames.take(1);
+    CHECK(!frames.check(1, now));
+    CHECK(frames.check(1, now + std::chrono::milliseconds(100)));
+}
+
+static void testNoLimit()
+{
+    TokenBucket bytes;
+    auto now = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < 100; i++) {
+        CHECK(bytes.check(1 << 20, now));
+        bytes.take(1 << 20);
+    }
+}
+
+int main()
+{
+    testFrameRate();
+    testCheck();
+    testNoLimit();
+
+    return EXIT_SUCCESS;
+}